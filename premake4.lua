@@ -32,3 +32,7 @@ solution "saurus"
 
       if os.getenv("SU_OPT_NO_FILE_IO") then defines { "SU_OPT_NO_FILE_IO" } end
       if os.getenv("SU_OPT_DYNLIB") then defines { "SU_OPT_DYNLIB" } end
+      if os.getenv("SU_OPT_PARALLEL_GC") then
+         defines { "SU_OPT_PARALLEL_GC" }
+         if gcc then links { "pthread" } end
+      end
@@ -130,7 +130,7 @@ static int encode_string(lua_State *L) {
 }
 
 int su_open_wrp(lua_State *L) {
-	su_state *s = su_init(NULL);
+	su_state *s = su_init(NULL, NULL);
 	su_libinit(s);
 	lua_pushlightuserdata(L, (void*)s);
 	return 1;
@@ -158,18 +158,20 @@ static int push_sexp(lua_State *L, su_state *s, value_t v) {
 			lua_pushboolean(L, v.obj.b);
 			return ret;
 		case SU_STRING:
-			lua_pushlstring(L, v.obj.str->str, v.obj.str->size - 1);
+			lua_pushlstring(L, v.obj.str->str, string_len(v.obj.str));
 			return ret;
 		case SU_SEQ:
-		case IT_SEQ:
 		case CELL_SEQ:
+		case CHUNK_SEQ:
+		case STRING_SEQ:
+		case LAZY_SEQ:
 			lua_newtable(L);
 			lua_pushinteger(L, 1);
-			ret = push_sexp(L, s, seq_first(s, v.obj.q));
+			ret = push_sexp(L, s, seq_first(s, &v));
 			if (ret) goto err;
 			lua_settable(L, -3);
 			lua_pushinteger(L, 2);
-			ret = push_sexp(L, s, seq_rest(s, v.obj.q));
+			ret = push_sexp(L, s, seq_rest(s, &v));
 			if (ret) goto err;
 			lua_settable(L, -3);
 			return ret;
@@ -68,7 +68,7 @@ int main(int argc, char *argv[]) {
 		}
 	}
 	
-	s = su_init(NULL);
+	s = su_init(NULL, NULL);
 	su_libinit(s);
 	
 	L = lua_open();
@@ -96,16 +96,12 @@ const char *su_version(int *major, int *minor, int *patch) {
 	return VERSION_STRING;
 }
 
-void *su_allocate(su_state *s, void *p, size_t n) {
-	void *np;
-	if (n) {
-		s->interupt |= IGC;
-		np = s->alloc(p, n);
-		su_assert(s, np != NULL, "Out of memory!");
-		return np;
-	} else {
-		return s->alloc(p, 0);
-	}
+void mem_error(su_state *s) {
+	su_error(s, "Out of memory!");
+}
+
+void *su_allocate(su_state *s, void *p, size_t osize, size_t nsize) {
+	return mem_allocate(s, p, osize, nsize, SU_ALLOC_NATIVE);
 }
 
 void push_value(su_state *s, value_t *v) {
@@ -113,11 +109,29 @@ void push_value(su_state *s, value_t *v) {
 	s->stack[s->stack_top++] = *v;
 }
 
+/* Two interned strings are only equal if they are the same object. */
+static int string_eq(string_t *a, string_t *b) {
+	if (a->flags & b->flags & STRING_INTERNED)
+		return 0;
+	if (string_len(a) != string_len(b))
+		return 0;
+	if ((a->flags & b->flags & STRING_HASHED) && a->hash != b->hash)
+		return 0;
+	return !memcmp(a->str, b->str, string_len(a));
+}
+
 int value_eq(value_t *a, value_t *b) {
 	if (a->type != b->type)
 		return 0;
-	if (a->type == SU_NUMBER && a->obj.num == b->obj.num)
-		return 1;
+	switch (a->type) {
+		case SU_NIL: return 1;
+		case SU_BOOLEAN: return a->obj.b == b->obj.b;
+		case SU_NUMBER: return a->obj.num == b->obj.num;
+	}
+	if (a->type == SU_STRING)
+		return a->obj.ptr == b->obj.ptr || string_eq(a->obj.str, b->obj.str);
+	if (a->type == CHUNK_SEQ || a->type == STRING_SEQ)
+		return a->obj.it.obj == b->obj.it.obj && a->obj.it.idx == b->obj.it.idx;
 	return a->obj.ptr == b->obj.ptr;
 }
 
@@ -130,13 +144,19 @@ void su_copy(su_state *s, int idx) {
 	push_value(s, STK(idx));
 }
 
+/* Pops the top value into idx. */
+void su_replace(su_state *s, int idx) {
+	s->stack[s->stack_top + idx] = *STK(-1);
+	s->stack_top--;
+}
+
 void su_copy_range(su_state *s, int idx, int num) {
 	memcpy(&s->stack[s->stack_top], &s->stack[s->stack_top + idx], sizeof(value_t) * num);
 	s->stack_top += num;
 }
 
 static reader_buffer_t *buffer_open(su_state *s, su_reader reader, void *data) {
-	reader_buffer_t *buffer = (reader_buffer_t*)su_allocate(s, NULL, sizeof(reader_buffer_t));
+	reader_buffer_t *buffer = (reader_buffer_t*)mem_allocate(s, NULL, 0, sizeof(reader_buffer_t), SU_ALLOC_STATE);
 	buffer->reader = reader;
 	buffer->data = data;
 	buffer->offset = 0;
@@ -148,8 +168,8 @@ static reader_buffer_t *buffer_open(su_state *s, su_reader reader, void *data) {
 
 static void buffer_close(su_state *s, reader_buffer_t *buffer) {
 	buffer->reader(NULL, buffer->data);
-	su_allocate(s, buffer->buffer, 0);
-	su_allocate(s, buffer, 0);
+	mem_allocate(s, buffer->buffer, buffer->size, 0, SU_ALLOC_STATE);
+	mem_allocate(s, buffer, sizeof(reader_buffer_t), 0, SU_ALLOC_STATE);
 }
 
 static int buffer_read(su_state *s, reader_buffer_t *buffer, void *dest, size_t num_bytes) {
@@ -158,6 +178,7 @@ static int buffer_read(su_state *s, reader_buffer_t *buffer, void *dest, size_t
 		const void *res;
 		size_t size = buffer->len - buffer->offset;
 		size_t num = num_bytes < size ? num_bytes : size;
+		size_t cap;
 		memcpy(((char*)dest) + dest_offset, &buffer->buffer[buffer->offset], num);
 
 		buffer->offset += num;
@@ -168,9 +189,10 @@ static int buffer_read(su_state *s, reader_buffer_t *buffer, void *dest, size_t
 		res = buffer->reader(&size, buffer->data);
 		if (!res || size == 0) return -1;
 
-		while (buffer->size < size) {
-			buffer->size = buffer->size * 2 + 1;
-			buffer->buffer = su_allocate(s, buffer->buffer, buffer->size);
+		if (buffer->size < size) {
+			for (cap = buffer->size; cap < size; cap = cap * 2 + 1);
+			buffer->buffer = mem_allocate(s, buffer->buffer, buffer->size, cap, SU_ALLOC_STATE);
+			buffer->size = cap;
 		}
 
 		buffer->offset = 0;
@@ -227,6 +249,16 @@ unsigned murmur(const void *key, int len, unsigned seed) {
 	return h;
 }
 
+/* Young objects move, so objects are hashed by an id that is taken from the address they had when first hashed. */
+static unsigned gc_identity(gc_t *obj) {
+	if (!obj->id) {
+		obj->id = murmur(&obj, sizeof(gc_t*), (unsigned)obj->type);
+		if (!obj->id)
+			obj->id = 1;
+	}
+	return obj->id;
+}
+
 unsigned hash_value(value_t *v) {
 	switch (v->type) {
 		case SU_NIL:
@@ -236,41 +268,514 @@ unsigned hash_value(value_t *v) {
 		case SU_NUMBER:
 			return murmur(&v->obj.num, sizeof(double), (unsigned)SU_NUMBER);
 		case SU_STRING:
-			return v->obj.str->hash;
-		default:
+			return string_hash(v->obj.str);
+		case SU_INV:
+		case SU_NATIVEFUNC:
+		case SU_NATIVEPTR:
 			return murmur(&v->obj.ptr, sizeof(void*), (unsigned)v->type);
+		default:
+			return gc_identity(v->obj.gc_object);
 	}
 }
 
-gc_t *gc_insert_object(su_state *s, gc_t *obj, su_object_type_t type) {
-	obj->type = type;
-	obj->flags = GC_FLAG_TRANS;
-	obj->next = s->gc_root;
-	s->gc_root = obj;
-	s->num_objects++;
-	return obj;
+/*
+	Strings are interned in an open addressing table with linear probing. The
+	table does not keep its strings alive, the collector clears the entries of
+	dead strings and leaves a tombstone so probe chains stay intact.
+*/
+
+#define STRING_TOMBSTONE (&string_tombstone)
+#define STRING_TABLE_MIN 256
+
+static string_t string_tombstone;
+
+static void strings_resize(su_state *s, unsigned cap) {
+	unsigned i, j;
+	string_t *str;
+	string_t **old = s->strings;
+	unsigned old_cap = s->strings_cap;
+	
+	s->strings = (string_t**)mem_allocate(s, NULL, 0, sizeof(string_t*) * cap, SU_ALLOC_STATE);
+	memset(s->strings, 0, sizeof(string_t*) * cap);
+	s->strings_cap = cap;
+	s->strings_used = s->strings_cnt;
+	
+	for (i = 0; i < old_cap; i++) {
+		str = old[i];
+		if (!str || str == STRING_TOMBSTONE)
+			continue;
+		for (j = str->hash & (cap - 1); s->strings[j]; j = (j + 1) & (cap - 1));
+		s->strings[j] = str;
+	}
+	mem_allocate(s, old, sizeof(string_t*) * old_cap, 0, SU_ALLOC_STATE);
 }
 
-gc_t *string_from_db(su_state *s, unsigned hash, unsigned size, const char *str) {
-	value_t key, v;
-	key.type = SU_NATIVEPTR;
-	key.obj.ptr = 0;
-	memcpy(&key.obj.ptr, &hash, sizeof(unsigned));
+void strings_sweep(su_state *s) {
+	unsigned i;
+	string_t *str;
+	for (i = 0; i < s->strings_cap; i++) {
+		str = s->strings[i];
+		if (str && str != STRING_TOMBSTONE && !gc_marked(s, &str->gc)) {
+			s->strings[i] = STRING_TOMBSTONE;
+			s->strings_cnt--;
+		}
+	}
+}
 
-	v = map_get(s, s->strings.obj.m, &key, hash);
-	if (v.type != SU_INV)
-		return v.obj.gc_object;
+gc_t *string_create(su_state *s, unsigned len, const char *str) {
+	string_t *v = (string_t*)gc_allocate_old(s, sizeof(string_t) + len, SU_STRING);
+	v->size = len;
+	v->hash = 0;
+	v->flags = 0;
+	v->str = v->data;
+	v->parent = NULL;
+	if (str) memcpy(v->str, str, len);
+	v->str[len] = '\0';
+	return &v->gc;
+}
 
-	v.type = SU_STRING;
-	v.obj.ptr = su_allocate(s, NULL, sizeof(string_t) + size);
-	v.obj.str->size = size;
-	memcpy(v.obj.str->str, str, size);
-	v.obj.str->str[size] = '\0';
-	v.obj.str->hash = hash;
-	gc_insert_object(s, v.obj.gc_object, SU_STRING);
-	s->strings = map_insert(s, s->strings.obj.m, &key, hash, &v);
+/* Slices of slices refer to the original string, so there is never a chain of parents. */
+gc_t *string_slice(su_state *s, string_t *str, unsigned start, unsigned len) {
+	string_t *v = (string_t*)gc_allocate_old(s, sizeof(string_t), SU_STRING);
+	v->size = len;
+	v->hash = 0;
+	v->flags = STRING_SLICE;
+	v->str = str->str + start;
+	v->parent = str->parent ? str->parent : &str->gc;
+	return &v->gc;
+}
+
+gc_t *string_char(su_state *s, char c) {
+	string_t **slot = &s->chars[(unsigned char)c];
+	if (!*slot)
+		*slot = (string_t*)string_from_db(s, 1, &c);
+	return &(*slot)->gc;
+}
+
+const char *string_cstr(su_state *s, string_t *str) {
+	char *buffer;
+	if (str->parent) {
+		buffer = (char*)mem_allocate(s, NULL, 0, str->size + 1, SU_ALLOC_STRING);
+		memcpy(buffer, str->str, str->size);
+		buffer[str->size] = '\0';
+		str->str = buffer;
+		str->parent = NULL;
+		str->flags |= STRING_DETACHED;
+	}
+	return str->str;
+}
+
+unsigned string_hash(string_t *str) {
+	if (!(str->flags & STRING_HASHED)) {
+		str->hash = murmur(str->str, string_len(str), 0);
+		str->flags |= STRING_HASHED;
+	}
+	return str->hash;
+}
+
+gc_t *string_from_db(su_state *s, unsigned len, const char *str) {
+	unsigned i, mask, cap, hash;
+	string_t *entry;
+	string_t **slot = NULL;
+	
+	/* Keep the load, tombstones included, under three quarters. */
+	if ((s->strings_used + 1) * 4 > s->strings_cap * 3) {
+		cap = s->strings_cap ? s->strings_cap : STRING_TABLE_MIN;
+		while ((s->strings_cnt + 1) * 2 > cap)
+			cap *= 2;
+		strings_resize(s, cap);
+	}
+	
+	hash = murmur(str, len, 0);
+	mask = s->strings_cap - 1;
+	for (i = hash & mask; (entry = s->strings[i]) != NULL; i = (i + 1) & mask) {
+		if (entry == STRING_TOMBSTONE) {
+			if (!slot) slot = &s->strings[i];
+		} else if (entry->hash == hash && string_len(entry) == len && !memcmp(entry->str, str, len)) {
+			return &entry->gc;
+		}
+	}
+	
+	if (!slot) {
+		slot = &s->strings[i];
+		s->strings_used++;
+	}
+	
+	entry = (string_t*)string_create(s, len, str);
+	entry->hash = hash;
+	entry->flags = STRING_INTERNED | STRING_HASHED;
+	
+	*slot = entry;
+	s->strings_cnt++;
+	return &entry->gc;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static const double powers_of_ten[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static char *format_digits(char *buffer, unsigned long n, int width) {
+	char tmp[16];
+	int i = 0;
+	do {
+		tmp[i++] = (char)('0' + n % 10);
+		n /= 10;
+	} while (n || i < width);
+	while (i)
+		*buffer++ = tmp[--i];
+	return buffer;
+}
+
+#ifdef SU_HAS_U64
+
+/*
+	Grisu2 by Florian Loitsch. The double and the halfway points to its
+	neighbours are scaled by a cached power of ten, so the digits come out of
+	64 bit integer arithmetic and stop as soon as they are between the two.
+	The cache holds 10^k for k from -348 in steps of 8, as the high and low
+	half of the significand and the binary exponent.
+*/
+static const struct {
+	unsigned long hi, lo;
+	int e;
+} cached_powers[] = {
+	{0xfa8fd5a0, 0x081c0288, -1220}, {0xbaaee17f, 0xa23ebf76, -1193}, {0x8b16fb20, 0x3055ac76, -1166},
+	{0xcf42894a, 0x5dce35ea, -1140}, {0x9a6bb0aa, 0x55653b2d, -1113}, {0xe61acf03, 0x3d1a45df, -1087},
+	{0xab70fe17, 0xc79ac6ca, -1060}, {0xff77b1fc, 0xbebcdc4f, -1034}, {0xbe5691ef, 0x416bd60c, -1007},
+	{0x8dd01fad, 0x907ffc3c, -980}, {0xd3515c28, 0x31559a83, -954}, {0x9d71ac8f, 0xada6c9b5, -927},
+	{0xea9c2277, 0x23ee8bcb, -901}, {0xaecc4991, 0x4078536d, -874}, {0x823c1279, 0x5db6ce57, -847},
+	{0xc2109436, 0x4dfb5637, -821}, {0x9096ea6f, 0x3848984f, -794}, {0xd77485cb, 0x25823ac7, -768},
+	{0xa086cfcd, 0x97bf97f4, -741}, {0xef340a98, 0x172aace5, -715}, {0xb23867fb, 0x2a35b28e, -688},
+	{0x84c8d4df, 0xd2c63f3b, -661}, {0xc5dd4427, 0x1ad3cdba, -635}, {0x936b9fce, 0xbb25c996, -608},
+	{0xdbac6c24, 0x7d62a584, -582}, {0xa3ab6658, 0x0d5fdaf6, -555}, {0xf3e2f893, 0xdec3f126, -529},
+	{0xb5b5ada8, 0xaaff80b8, -502}, {0x87625f05, 0x6c7c4a8b, -475}, {0xc9bcff60, 0x34c13053, -449},
+	{0x964e858c, 0x91ba2655, -422}, {0xdff97724, 0x70297ebd, -396}, {0xa6dfbd9f, 0xb8e5b88f, -369},
+	{0xf8a95fcf, 0x88747d94, -343}, {0xb9447093, 0x8fa89bcf, -316}, {0x8a08f0f8, 0xbf0f156b, -289},
+	{0xcdb02555, 0x653131b6, -263}, {0x993fe2c6, 0xd07b7fac, -236}, {0xe45c10c4, 0x2a2b3b06, -210},
+	{0xaa242499, 0x697392d3, -183}, {0xfd87b5f2, 0x8300ca0e, -157}, {0xbce50864, 0x92111aeb, -130},
+	{0x8cbccc09, 0x6f5088cc, -103}, {0xd1b71758, 0xe219652c, -77}, {0x9c400000, 0x00000000, -50},
+	{0xe8d4a510, 0x00000000, -24}, {0xad78ebc5, 0xac620000, 3}, {0x813f3978, 0xf8940984, 30},
+	{0xc097ce7b, 0xc90715b3, 56}, {0x8f7e32ce, 0x7bea5c70, 83}, {0xd5d238a4, 0xabe98068, 109},
+	{0x9f4f2726, 0x179a2245, 136}, {0xed63a231, 0xd4c4fb27, 162}, {0xb0de6538, 0x8cc8ada8, 189},
+	{0x83c7088e, 0x1aab65db, 216}, {0xc45d1df9, 0x42711d9a, 242}, {0x924d692c, 0xa61be758, 269},
+	{0xda01ee64, 0x1a708dea, 295}, {0xa26da399, 0x9aef774a, 322}, {0xf209787b, 0xb47d6b85, 348},
+	{0xb454e4a1, 0x79dd1877, 375}, {0x865b8692, 0x5b9bc5c2, 402}, {0xc83553c5, 0xc8965d3d, 428},
+	{0x952ab45c, 0xfa97a0b3, 455}, {0xde469fbd, 0x99a05fe3, 481}, {0xa59bc234, 0xdb398c25, 508},
+	{0xf6c69a72, 0xa3989f5c, 534}, {0xb7dcbf53, 0x54e9bece, 561}, {0x88fcf317, 0xf22241e2, 588},
+	{0xcc20ce9b, 0xd35c78a5, 614}, {0x98165af3, 0x7b2153df, 641}, {0xe2a0b5dc, 0x971f303a, 667},
+	{0xa8d9d153, 0x5ce3b396, 694}, {0xfb9b7cd9, 0xa4a7443c, 720}, {0xbb764c4c, 0xa7a44410, 747},
+	{0x8bab8eef, 0xb6409c1a, 774}, {0xd01fef10, 0xa657842c, 800}, {0x9b10a4e5, 0xe9913129, 827},
+	{0xe7109bfb, 0xa19c0c9d, 853}, {0xac2820d9, 0x623bf429, 880}, {0x80444b5e, 0x7aa7cf85, 907},
+	{0xbf21e440, 0x03acdd2d, 933}, {0x8e679c2f, 0x5e44ff8f, 960}, {0xd433179d, 0x9c8cb841, 986},
+	{0x9e19db92, 0xb4e31ba9, 1013}, {0xeb96bf6e, 0xbadf77d9, 1039}, {0xaf87023b, 0x9bf0ee6b, 1066}
+};
+
+typedef struct {
+	u64_t f;
+	int e;
+} diy_fp_t;
+
+/* The high half of the 128 bit product, rounded. */
+static diy_fp_t diy_mul(diy_fp_t x, diy_fp_t y) {
+	diy_fp_t r;
+	u64_t mask = 0xffffffffUL;
+	u64_t a = x.f >> 32, b = x.f & mask;
+	u64_t c = y.f >> 32, d = y.f & mask;
+	u64_t ad = a * d, bc = b * c;
+	u64_t mid = ((b * d) >> 32) + (ad & mask) + (bc & mask) + 0x80000000UL;
+	r.f = a * c + (ad >> 32) + (bc >> 32) + (mid >> 32);
+	r.e = x.e + y.e + 64;
+	return r;
+}
+
+/* Moves the last digit down while that brings it closer to the number and keeps it inside the bounds. */
+static void grisu_round(char *digits, int len, u64_t delta, u64_t rest, u64_t ten_kappa, u64_t wp_w) {
+	while (rest < wp_w && delta - rest >= ten_kappa && (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+		digits[len - 1]--;
+		rest += ten_kappa;
+	}
+}
+
+/* Writes the digits of a positive number and returns how many, *k is the power of ten of the last one. */
+static int grisu2(char *digits, double n, int *k) {
+	union { double d; u64_t u; } bits;
+	diy_fp_t w, plus, minus, c;
+	u64_t one, p2, delta, wp_w, unit;
+	unsigned long p1, div;
+	int i, kappa, len = 0;
+	double dk;
+	
+	bits.d = n;
+	i = (int)(bits.u >> 52) & 0x7ff;
+	w.f = bits.u & (((u64_t)1 << 52) - 1);
+	if (i) {
+		w.f += (u64_t)1 << 52;
+		w.e = i - 1075;
+	} else {
+		w.e = -1074;
+	}
+	
+	/* The lower neighbour is closer when the significand is a power of two. */
+	plus.f = (w.f << 1) + 1;
+	plus.e = w.e - 1;
+	while (!(plus.f & ((u64_t)1 << 53))) {
+		plus.f <<= 1;
+		plus.e--;
+	}
+	plus.f <<= 10;
+	plus.e -= 10;
+	if (w.f == (u64_t)1 << 52) {
+		minus.f = (w.f << 2) - 1;
+		minus.e = w.e - 2;
+	} else {
+		minus.f = (w.f << 1) - 1;
+		minus.e = w.e - 1;
+	}
+	minus.f <<= minus.e - plus.e;
+	minus.e = plus.e;
+	while (!(w.f & ((u64_t)1 << 63))) {
+		w.f <<= 1;
+		w.e--;
+	}
+	
+	dk = (-61 - plus.e) * 0.30102999566398114 + 347;
+	i = (int)dk;
+	if (dk - i > 0.0)
+		i++;
+	i = (i >> 3) + 1;
+	*k = 348 - i * 8;
+	c.f = ((u64_t)cached_powers[i].hi << 32) | cached_powers[i].lo;
+	c.e = cached_powers[i].e;
+	
+	w = diy_mul(w, c);
+	plus = diy_mul(plus, c);
+	minus = diy_mul(minus, c);
+	plus.f--;
+	minus.f++;
+	delta = plus.f - minus.f;
+	wp_w = plus.f - w.f;
+	
+	/* The integral part of the upper bound fits in 32 bits, then the fraction is shifted out one digit at a time. */
+	one = (u64_t)1 << -plus.e;
+	p1 = (unsigned long)(plus.f >> -plus.e);
+	p2 = plus.f & (one - 1);
+	for (kappa = 1, div = 1; p1 / div >= 10; kappa++)
+		div *= 10;
+	
+	while (kappa > 0) {
+		i = (int)(p1 / div);
+		p1 %= div;
+		if (i || len)
+			digits[len++] = (char)('0' + i);
+		kappa--;
+		if ((((u64_t)p1 << -plus.e) + p2) <= delta) {
+			*k += kappa;
+			grisu_round(digits, len, delta, ((u64_t)p1 << -plus.e) + p2, (u64_t)div << -plus.e, wp_w);
+			return len;
+		}
+		div /= 10;
+	}
+	
+	for (unit = 1;;) {
+		p2 *= 10;
+		delta *= 10;
+		unit *= 10;
+		i = (int)(p2 >> -plus.e);
+		if (i || len)
+			digits[len++] = (char)('0' + i);
+		p2 &= one - 1;
+		kappa--;
+		if (p2 < delta) {
+			*k += kappa;
+			grisu_round(digits, len, delta, p2, one, wp_w * unit);
+			return len;
+		}
+	}
+}
+
+/*
+	Grisu2 keeps clear of the bounds, so it can give 16 or 17 digits when a
+	shorter decimal reads back from right next to one. The digits are rounded
+	to prec and kept if they give the same number, parsing them is exact when
+	they fit in the significand and the power of ten is small enough. A last
+	digit of 5 may just as well have been rounded down.
+*/
+static int grisu_shorten(char *digits, int *len, int *k, double n, int prec) {
+	char tmp[32];
+	double m;
+	int i, e, up;
+	
+	for (up = digits[prec] >= '5';; up = 0) {
+		memcpy(tmp, digits, prec);
+		e = *k + *len - prec;
+		if (up) {
+			for (i = prec - 1; i >= 0 && tmp[i] == '9'; i--)
+				tmp[i] = '0';
+			if (i < 0) {
+				tmp[0] = '1';
+				e++;
+			} else {
+				tmp[i]++;
+			}
+		}
+		for (m = 0.0, i = 0; i < prec; i++)
+			m = m * 10.0 + (tmp[i] - '0');
+		
+		if (m <= 9007199254740992.0 && e >= -22 && e <= 22) {
+			m = e < 0 ? m / powers_of_ten[-e] : m * powers_of_ten[e];
+		} else {
+			sprintf(tmp + prec, "e%d", e);
+			m = strtod(tmp, NULL);
+		}
+		if (m == n) {
+			memcpy(digits, tmp, prec);
+			*len = prec;
+			*k = e;
+			return 1;
+		}
+		if (!up || digits[prec] != '5' || prec + 1 != *len)
+			return 0;
+	}
+}
 
-	return v.obj.gc_object;
+#endif
+
+/*
+	Writes the shortest decimal that reads back as the same double. Integers are
+	written digit by digit, split in two halves that fit in 32 bits. Anything
+	else gets its digits from Grisu2 and is laid out like %g with at least 15
+	digits of precision, so no more than is needed for the number is printed.
+*/
+void number_format(char *buffer, double n) {
+	int prec;
+	double hi;
+#ifdef SU_HAS_U64
+	char digits[24];
+	int len, k, exp;
+#endif
+	
+	if (n != n) {
+		strcpy(buffer, "nan");
+		return;
+	}
+	if (n == HUGE_VAL || n == -HUGE_VAL) {
+		strcpy(buffer, n < 0 ? "-inf" : "inf");
+		return;
+	}
+	
+	if (n == floor(n) && fabs(n) < 1e18) {
+		/* Negative zero compares equal to zero, only its reciprocal shows the sign. */
+		if (n < 0 || (n == 0 && 1.0 / n < 0)) {
+			*buffer++ = '-';
+			n = -n;
+		}
+		hi = floor(n / 1e9);
+		if (hi > 0) {
+			buffer = format_digits(buffer, (unsigned long)hi, 0);
+			buffer = format_digits(buffer, (unsigned long)(n - hi * 1e9), 9);
+		} else {
+			buffer = format_digits(buffer, (unsigned long)n, 0);
+		}
+		*buffer = '\0';
+		return;
+	}
+	
+#ifdef SU_HAS_U64
+	if (n < 0) {
+		*buffer++ = '-';
+		n = -n;
+	}
+	len = grisu2(digits, n, &k);
+	for (prec = 15; prec < len; prec++) {
+		if (grisu_shorten(digits, &len, &k, n, prec))
+			break;
+	}
+	while (len > 1 && digits[len - 1] == '0') {
+		len--;
+		k++;
+	}
+	exp = len + k - 1;
+	prec = len > 15 ? len : 15;
+	
+	if (exp < -4 || exp >= prec) {
+		*buffer++ = digits[0];
+		if (len > 1) {
+			*buffer++ = '.';
+			memcpy(buffer, digits + 1, len - 1);
+			buffer += len - 1;
+		}
+		*buffer++ = 'e';
+		*buffer++ = exp < 0 ? '-' : '+';
+		buffer = format_digits(buffer, (unsigned long)(exp < 0 ? -exp : exp), 2);
+	} else if (exp < 0) {
+		*buffer++ = '0';
+		*buffer++ = '.';
+		memset(buffer, '0', -exp - 1);
+		buffer += -exp - 1;
+		memcpy(buffer, digits, len);
+		buffer += len;
+	} else if (len > exp + 1) {
+		memcpy(buffer, digits, exp + 1);
+		buffer += exp + 1;
+		*buffer++ = '.';
+		memcpy(buffer, digits + exp + 1, len - exp - 1);
+		buffer += len - exp - 1;
+	} else {
+		memcpy(buffer, digits, len);
+		memset(buffer + len, '0', exp + 1 - len);
+		buffer += exp + 1;
+	}
+	*buffer = '\0';
+#else
+	for (prec = 15; prec < 17; prec++) {
+		sprintf(buffer, "%.*g", prec, n);
+		if (strtod(buffer, NULL) == n)
+			return;
+	}
+	sprintf(buffer, "%.17g", n);
+#endif
+}
+
+/*
+	A decimal with at most 15 significant digits and a power of ten up to 22
+	are both exact doubles, so a single multiplication or division rounds
+	correctly. Everything else is left to strtod.
+*/
+double number_parse(const char *str) {
+	const char *p = str;
+	double m = 0.0;
+	int neg = 0, digits = 0, any = 0, exp = 0, e = 0, eneg = 0;
+	
+	if (*p == '-' || *p == '+')
+		neg = *p++ == '-';
+	for (; *p >= '0' && *p <= '9'; p++, any = 1) {
+		m = m * 10.0 + (*p - '0');
+		if (m != 0.0) digits++;
+	}
+	if (*p == '.') {
+		for (p++; *p >= '0' && *p <= '9'; p++, any = 1) {
+			m = m * 10.0 + (*p - '0');
+			if (m != 0.0) digits++;
+			exp--;
+		}
+	}
+	if (any && (*p == 'e' || *p == 'E')) {
+		p++;
+		if (*p == '-' || *p == '+')
+			eneg = *p++ == '-';
+		for (any = 0; *p >= '0' && *p <= '9' && e < 1000; p++, any = 1)
+			e = e * 10 + (*p - '0');
+		exp += eneg ? -e : e;
+	}
+	
+	if (!any || *p != '\0' || digits > 15 || exp < -22 || exp > 22)
+		return strtod(str, NULL);
+	
+	m = exp < 0 ? m / powers_of_ten[-exp] : m * powers_of_ten[exp];
+	return neg ? -m : m;
 }
 
 const char *su_stringify(su_state *s, int idx) {
@@ -282,14 +787,11 @@ const char *su_stringify(su_state *s, int idx) {
 		case SU_BOOLEAN:
 			return v->obj.b ? "true" : "false";
 		case SU_NUMBER:
-			tmp = (int)v->obj.num;
-			if (v->obj.num == (double)tmp)
-				sprintf(s->scratch_pad, "%i", tmp);
-			else
-				sprintf(s->scratch_pad, "%f", v->obj.num);
+			number_format(s->scratch_pad, v->obj.num);
 			break;
 		case SU_STRING:
-			sprintf(s->scratch_pad, "%s", ((string_t*)v->obj.gc_object)->str);
+			tmp = (int)string_len(v->obj.str);
+			sprintf(s->scratch_pad, "%.*s", tmp < SCRATCH_PAD_SIZE ? tmp : SCRATCH_PAD_SIZE - 1, v->obj.str->str);
 			break;
 		case SU_FUNCTION:
 			sprintf(s->scratch_pad, "<function %p>", (void*)v->obj.func);
@@ -312,11 +814,34 @@ const char *su_stringify(su_state *s, int idx) {
 		case SU_LOCAL:
 			sprintf(s->scratch_pad, "<reference %p>", v->obj.ptr);
 			break;
+		case SU_TRANSIENT:
+			sprintf(s->scratch_pad, "<transient %p>", v->obj.ptr);
+			break;
+		case SU_WEAK:
+			sprintf(s->scratch_pad, "<weak-reference %p>", v->obj.ptr);
+			break;
+		case SU_EPHEMERON:
+			sprintf(s->scratch_pad, "<ephemeron %p>", v->obj.ptr);
+			break;
+		case REDUCED:
+			sprintf(s->scratch_pad, "<reduced %p>", v->obj.ptr);
+			break;
+		case XFORM:
+			sprintf(s->scratch_pad, "<stage %p>", v->obj.ptr);
+			break;
+		case STRING_BUILDER:
+			sprintf(s->scratch_pad, "<string-builder %p>", v->obj.ptr);
+			break;
+		case ROPE:
+			sprintf(s->scratch_pad, "<rope %p>", v->obj.ptr);
+			break;
 		case SU_INV:
 			su_error(s, "Invalid type!");
 			break;
-		case IT_SEQ:
 		case CELL_SEQ:
+		case CHUNK_SEQ:
+		case STRING_SEQ:
+		case LAZY_SEQ:
 			sprintf(s->scratch_pad, "<sequence %p>", v->obj.ptr);
 			break;
 		default:
@@ -327,19 +852,18 @@ const char *su_stringify(su_state *s, int idx) {
 
 static void update_global_ref(su_state *s) {
 	value_t key, val;
-	unsigned hash = murmur("_G", 3, 0);
 	key.type = SU_STRING;
-	key.obj.gc_object = string_from_db(s, hash, 3, "_G");
+	key.obj.gc_object = string_from_db(s, 2, "_G");
 	val = ref_local(s, &s->globals);
-
-	hash = hash_value(&key);
-	s->globals = map_insert(s, s->globals.obj.m, &key, hash, &val);
+	s->globals = map_insert(s, s->globals.obj.m, &key, &val);
 }
 
 static int isseq(su_state *s, int idx) {
 	switch (STK(idx)->type) {
-		case IT_SEQ:
 		case CELL_SEQ:
+		case CHUNK_SEQ:
+		case STRING_SEQ:
+		case LAZY_SEQ:
 			return 1;
 		default:
 			return 0;
@@ -375,6 +899,8 @@ void su_pushnumber(su_state *s, double n) {
 double su_tonumber(su_state *s, int idx) {
 	if (STK(idx)->type == SU_NUMBER)
 		return STK(idx)->obj.num;
+	if (STK(idx)->type == SU_STRING)
+		return number_parse(su_tostring(s, idx, NULL));
 	return 0.0;
 }
 
@@ -391,6 +917,37 @@ void *su_topointer(su_state *s, int idx) {
 	return NULL;
 }
 
+/* The data is zeroed, so it can be traced before the native has filled it in. */
+void *su_newdata(su_state *s, unsigned size, const su_data_class_t *vt) {
+	value_t v;
+	v.type = SU_NATIVEDATA;
+	v.obj.data = (native_data_t*)gc_allocate_old(s, sizeof(native_data_t) + size - 1, SU_NATIVEDATA);
+	v.obj.data->vt = vt;
+	memset(v.obj.data->data, 0, size);
+	push_value(s, &v);
+	return v.obj.data->data;
+}
+
+void *su_todata(su_state *s, int idx, const su_data_class_t *vt) {
+	if (STK(idx)->type == SU_NATIVEDATA && STK(idx)->obj.data->vt == vt)
+		return STK(idx)->obj.data->data;
+	return NULL;
+}
+
+/* Pops the top value into a slot of the native data at idx. */
+void su_data_set(su_state *s, int idx, su_value *slot) {
+	gc_barrier(s, STK(idx)->obj.gc_object);
+	*(value_t*)slot = *STK(-1);
+	su_pop(s, 1);
+}
+
+void su_data_get(su_state *s, su_value *slot) {
+	if (((value_t*)slot)->type == SU_INV)
+		su_pushnil(s);
+	else
+		push_value(s, (value_t*)slot);
+}
+
 void su_pushinteger(su_state *s, int i) {
 	su_pushnumber(s, (double)i);
 }
@@ -415,19 +972,40 @@ int su_toboolean(su_state *s, int idx) {
 void su_pushbytes(su_state *s, const char *ptr, unsigned size) {
 	value_t v;
 	v.type = SU_STRING;
-	v.obj.gc_object = string_from_db(s, murmur(ptr, size, 0), size, ptr);
+	if (size > STRING_INTERN_MAX)
+		v.obj.gc_object = string_create(s, size, ptr);
+	else
+		v.obj.gc_object = string_from_db(s, size, ptr);
+	push_value(s, &v);
+}
+
+char *su_newbytes(su_state *s, unsigned size) {
+	value_t v;
+	v.type = SU_STRING;
+	v.obj.gc_object = string_create(s, size, NULL);
 	push_value(s, &v);
+	return v.obj.str->str;
 }
 
 void su_pushstring(su_state *s, const char *str) {
-	su_pushbytes(s, str, (unsigned)strlen(str) + 1);
+	su_pushbytes(s, str, (unsigned)strlen(str));
 }
 
 const char *su_tostring(su_state *s, int idx, unsigned *size) {
 	string_t *str;
 	if (STK(idx)->type == SU_STRING) {
 		str = (string_t*)STK(idx)->obj.gc_object;
-		if (size) *size = str->size;
+		if (size) *size = str->size + 1;
+		return string_cstr(s, str);
+	}
+	return NULL;
+}
+
+const char *su_tochars(su_state *s, int idx, unsigned *len) {
+	string_t *str;
+	if (STK(idx)->type == SU_STRING) {
+		str = STK(idx)->obj.str;
+		*len = string_len(str);
 		return str->str;
 	}
 	return NULL;
@@ -495,9 +1073,18 @@ static const char *type_name(su_object_type_t type) {
 		case SU_VECTOR: return "vector";
 		case SU_MAP: return "map";
 		case SU_LOCAL: return "reference";
+		case SU_TRANSIENT: return "transient";
+		case SU_WEAK: return "weak-reference";
+		case SU_EPHEMERON: return "ephemeron";
+		case REDUCED: return "reduced";
+		case XFORM: return "stage";
+		case STRING_BUILDER: return "string-builder";
+		case ROPE: return "rope";
 		case SU_SEQ:
 		case CELL_SEQ:
-		case IT_SEQ:
+		case CHUNK_SEQ:
+		case STRING_SEQ:
+		case LAZY_SEQ:
 			return "sequence";
 		default: assert(0);
 	}
@@ -511,12 +1098,13 @@ const char *su_type_name(su_state *s, int idx) {
 void su_map(su_state *s, int num) {
 	int i;
 	value_t k, v;
+	gc_t *edit = transient_edit(s);
 	value_t m = map_create_empty(s);
 	su_assert(s, num % 2 == 0, "Expected key value pairs!");
 	for (i = num; i > 0; i -= 2) {
 		k = *STK(-i);
 		v = *STK(-i + 1);
-		m = map_insert(s, m.obj.m, &k, hash_value(&k), &v);
+		map_insert_transient(s, m.obj.m, edit, &k, &v);
 	}
 	push_value(s, &m);
 }
@@ -527,8 +1115,7 @@ int su_map_length(su_state *s, int idx) {
 
 int su_map_get(su_state *s, int idx) {
 	value_t v = *STK(-1);
-	unsigned hash = hash_value(&v);
-	v = map_get(s, STK(idx)->obj.m, &v, hash);
+	v = map_get(s, STK(idx)->obj.m, &v);
 	if (v.type == SU_INV)
 		return 0;
 	push_value(s, &v);
@@ -537,22 +1124,75 @@ int su_map_get(su_state *s, int idx) {
 
 void su_map_insert(su_state *s, int idx) {
 	value_t key = *STK(-2);
-	unsigned hash = hash_value(&key);
-	key = map_insert(s, STK(idx)->obj.m, &key, hash, STK(-1));
+	key = map_insert(s, STK(idx)->obj.m, &key, STK(-1));
 	push_value(s, &key);
 }
 
 void su_map_remove(su_state *s, int idx) {
 	value_t key = *STK(-1);
-	unsigned hash = hash_value(&key);
-	key = map_remove(s, STK(idx)->obj.m, &key, hash);
+	key = map_remove(s, STK(idx)->obj.m, &key);
 	push_value(s, &key);
 }
 
 int su_map_has(su_state *s, int idx) {
 	value_t v = *STK(-1);
-	unsigned hash = hash_value(&v);
-	return map_get(s, STK(idx)->obj.m, &v, hash).type != SU_INV;
+	return map_get(s, STK(idx)->obj.m, &v).type != SU_INV;
+}
+
+static transient_t *get_transient(su_state *s, int idx, su_object_type_t type) {
+	transient_t *t = (transient_t*)STK(idx)->obj.gc_object;
+	su_assert(s, t->edit != 0, "Transient used after persistent!");
+	su_assert(s, t->coll.type == type, "Expected transient %s!", type_name(type));
+	return t;
+}
+
+void su_vector_transient(su_state *s, int idx) {
+	value_t v = transient_create(s, STK(idx));
+	push_value(s, &v);
+}
+
+void su_map_transient(su_state *s, int idx) {
+	value_t v = transient_create(s, STK(idx));
+	push_value(s, &v);
+}
+
+void su_persistent(su_state *s, int idx) {
+	value_t v = transient_persistent(s, (transient_t*)STK(idx)->obj.gc_object);
+	push_value(s, &v);
+}
+
+void su_transient_push(su_state *s, int idx, int num) {
+	int i;
+	transient_t *t = get_transient(s, idx, SU_VECTOR);
+	for (i = 0; i < num; i++)
+		vector_push_transient(s, t->coll.obj.vec, t->edit, STK(-(num - i)));
+	su_pop(s, num);
+}
+
+void su_transient_set(su_state *s, int idx) {
+	value_t key;
+	transient_t *t = (transient_t*)STK(idx)->obj.gc_object;
+	if (t->coll.type == SU_VECTOR) {
+		t = get_transient(s, idx, SU_VECTOR);
+		vector_set_transient(s, t->coll.obj.vec, t->edit, (int)STK(-2)->obj.num, STK(-1));
+	} else {
+		t = get_transient(s, idx, SU_MAP);
+		key = *STK(-2);
+		map_insert_transient(s, t->coll.obj.m, t->edit, &key, STK(-1));
+	}
+	su_pop(s, 2);
+}
+
+void su_transient_pop(su_state *s, int idx) {
+	transient_t *t = get_transient(s, idx, SU_VECTOR);
+	vector_pop_transient(s, t->coll.obj.vec, t->edit);
+}
+
+void su_transient_remove(su_state *s, int idx) {
+	value_t key = *STK(-1);
+	transient_t *t = get_transient(s, idx, SU_MAP);
+	map_remove_transient(s, t->coll.obj.m, t->edit, &key);
+	su_pop(s, 1);
 }
 
 void su_list(su_state *s, int num) {
@@ -561,15 +1201,33 @@ void su_list(su_state *s, int num) {
 }
 
 void su_first(su_state *s, int idx) {
-	value_t v = seq_first(s, STK(idx)->obj.q);
+	value_t v = seq_first(s, STK(idx));
 	push_value(s, &v);
 }
 
 void su_rest(su_state *s, int idx) {
-	value_t v = seq_rest(s, STK(idx)->obj.q);
+	value_t v = seq_rest(s, STK(idx));
+	push_value(s, &v);
+}
+
+int su_chunk_first(su_state *s, int idx) {
+	int n;
+	su_assert(s, s->stack_top + 32 <= STACK_SIZE, "Stack overflow!");
+	n = seq_chunk(s, STK(idx), &s->stack[s->stack_top]);
+	s->stack_top += n;
+	return n;
+}
+
+void su_chunk_rest(su_state *s, int idx) {
+	value_t v = seq_chunk_rest(s, STK(idx));
 	push_value(s, &v);
 }
 
+void su_lazy_seq(su_state *s) {
+	value_t v = lazy_create(s, STK(-1));
+	s->stack[s->stack_top - 1] = v;
+}
+
 void su_cons(su_state *s, int idx) {
 	value_t v = cell_create(s, STK(-1), STK(idx));
 	push_value(s, &v);
@@ -589,7 +1247,7 @@ void su_seq(su_state *s, int idx) {
 			v = it_create_string(s, seq->obj.str);
 			break;
 		case SU_SEQ:
-			v = *seq;
+			v = seq->type == LAZY_SEQ ? lazy_force(s, (lazy_seq_t*)seq->obj.q) : *seq;
 			break;
 		default:
 			su_error(s, "Can't sequence object of type: %s", type_name((su_object_type_t)seq->type));
@@ -597,11 +1255,17 @@ void su_seq(su_state *s, int idx) {
 	push_value(s, &v);
 }
 
-void su_vector(su_state *s, int num) {
+static value_t vector_from_stack(su_state *s, int num) {
 	int i;
+	gc_t *edit = transient_edit(s);
 	value_t vec = vector_create_empty(s);
 	for (i = 0; i < num; i++)
-		vec = vector_push(s, vec.obj.vec, STK(-(num - i)));
+		vector_push_transient(s, vec.obj.vec, edit, STK(-(num - i)));
+	return vec;
+}
+
+void su_vector(su_state *s, int num) {
+	value_t vec = vector_from_stack(s, num);
 	push_value(s, &vec);
 }
 
@@ -620,9 +1284,16 @@ void su_vector_set(su_state *s, int idx) {
 
 void su_vector_push(su_state *s, int idx, int num) {
 	int i;
+	gc_t *edit;
 	value_t vec = *STK(idx);
-	for (i = 0; i < num; i++)
-		vec = vector_push(s, vec.obj.vec, STK(-(num - i)));
+	if (num == 1) {
+		vec = vector_push(s, vec.obj.vec, STK(-1));
+	} else if (num > 1) {
+		edit = transient_edit(s);
+		vec = vector_transient(s, vec.obj.vec, edit);
+		for (i = 0; i < num; i++)
+			vector_push_transient(s, vec.obj.vec, edit, STK(-(num - i)));
+	}
 	push_value(s, &vec);
 }
 
@@ -636,12 +1307,412 @@ void su_vector_pop(su_state *s, int idx, int num) {
 }
 
 static void push_varg(su_state *s, int num) {
+	value_t vec = vector_from_stack(s, num);
+	su_pop(s, num);
+	push_value(s, &vec);
+}
+
+#define MAX_XFORMS 32
+
+typedef struct reducer reducer_t;
+typedef int (*reducer_step_t)(su_state *s, reducer_t *r, value_t *args, int num);
+
+/*
+	State of a running fold. 'func' and 'acc' are absolute stack positions,
+	the stages of a pipeline are stored from 'xf' and up. A non-null edit
+	means the accumulator is a transient collection that is written to directly.
+*/
+struct reducer {
+	reducer_step_t step;
+	int func, acc;
+	int xf, num_xf;
+	int count[MAX_XFORMS];
+	gc_t *edit;
+};
+
+/* Returns non-zero if the function asked to stop with 'reduced'. */
+static int reduce_call(su_state *s, reducer_t *r, value_t *args, int num) {
 	int i;
-	value_t vec = vector_create_empty(s);
+	su_assert(s, s->stack_top + num + 2 <= STACK_SIZE, "Stack overflow!");
+	s->stack[s->stack_top++] = s->stack[r->func];
+	s->stack[s->stack_top++] = s->stack[r->acc];
 	for (i = 0; i < num; i++)
-		vec = vector_push(s, vec.obj.vec, STK(-(num - i)));
+		s->stack[s->stack_top++] = args[i];
+	
+	su_call(s, num + 1, 1);
+	s->stack[r->acc] = *STK(-1);
+	su_pop(s, 1);
+	
+	if (s->stack[r->acc].type == REDUCED) {
+		s->stack[r->acc] = ((reduced_t*)s->stack[r->acc].obj.gc_object)->val;
+		return 1;
+	}
+	return 0;
+}
+
+static int istrue(value_t *v) {
+	return v->type != SU_NIL && (v->type != SU_BOOLEAN || v->obj.b);
+}
+
+static void transduce_sink(su_state *s, reducer_t *r, value_t *v) {
+	value_t key, val;
+	value_t *acc = &s->stack[r->acc];
+	if (acc->type == SU_VECTOR) {
+		vector_push_transient(s, acc->obj.vec, r->edit, v);
+	} else {
+		su_assert(s, v->type == SU_VECTOR && vector_length(v->obj.vec) == 2, "Expected key-value pair!");
+		key = vector_index(s, v->obj.vec, 0);
+		val = vector_index(s, v->obj.vec, 1);
+		map_insert_transient(s, acc->obj.m, r->edit, &key, &val);
+	}
+}
+
+/* Runs one value through all stages, the value is kept on the stack while doing so. */
+static int transduce_step(su_state *s, reducer_t *r, value_t *args, int num) {
+	int i, pass, stop = 0;
+	xform_t *x;
+	push_value(s, args);
+	
+	for (i = 0; i < r->num_xf; i++) {
+		x = (xform_t*)s->stack[r->xf + i].obj.gc_object;
+		switch (x->kind) {
+			case SU_XF_MAP:
+				push_value(s, &x->arg);
+				su_copy(s, -2);
+				su_call(s, 1, 1);
+				s->stack[s->stack_top - 2] = *STK(-1);
+				su_pop(s, 1);
+				break;
+			case SU_XF_FILTER:
+				push_value(s, &x->arg);
+				su_copy(s, -2);
+				su_call(s, 1, 1);
+				pass = istrue(STK(-1));
+				su_pop(s, 1);
+				if (!pass) {
+					su_pop(s, 1);
+					return stop;
+				}
+				break;
+			case SU_XF_TAKE:
+				if (r->count[i] >= (int)x->arg.obj.num) {
+					su_pop(s, 1);
+					return 1;
+				}
+				if (++r->count[i] >= (int)x->arg.obj.num)
+					stop = 1;
+				break;
+			case SU_XF_DROP:
+				if (r->count[i] < (int)x->arg.obj.num) {
+					r->count[i]++;
+					su_pop(s, 1);
+					return stop;
+				}
+				break;
+			default:
+				assert(0);
+		}
+	}
+	
+	if (r->edit)
+		transduce_sink(s, r, STK(-1));
+	else
+		stop |= reduce_call(s, r, STK(-1), 1);
+	su_pop(s, 1);
+	return stop;
+}
+
+static void reduce_vector(su_state *s, reducer_t *r, vector_t *v, int kv) {
+	int i, j, n;
+	value_t args[2];
+	vector_node_t *leaf;
+	args[0].type = SU_NUMBER;
+	
+	for (i = 0; i < v->cnt; i += 32) {
+		leaf = vector_leaf(v, i);
+		n = v->cnt - i < 32 ? v->cnt - i : 32;
+		for (j = 0; j < n; j++) {
+			if (kv) {
+				args[0].obj.num = (double)(i + j);
+				args[1] = leaf->data[j];
+				if (r->step(s, r, args, 2))
+					return;
+			} else if (r->step(s, r, &leaf->data[j], 1)) {
+				return;
+			}
+		}
+	}
+}
+
+static void reduce_map(su_state *s, reducer_t *r, map_t *m, int kv) {
+	map_iter_t it;
+	value_t args[2];
+	value_t *pair;
+	
+	map_iter_init(&it, m);
+	while ((pair = map_iter_next(&it))) {
+		args[0] = pair[0];
+		args[1] = pair[1];
+		if (kv) {
+			if (r->step(s, r, args, 2))
+				return;
+		} else {
+			push_value(s, &args[0]);
+			push_value(s, &args[1]);
+			args[0] = vector_from_stack(s, 2);
+			su_pop(s, 2);
+			if (r->step(s, r, args, 1))
+				return;
+		}
+	}
+}
+
+/* The cursor is kept on the stack so that chunks created on the way stay reachable. */
+static void reduce_seq(su_state *s, reducer_t *r, int cursor, int kv) {
+	int i, n;
+	chunk_seq_t *c;
+	value_t args[2];
+	value_t *q = &s->stack[cursor];
+	args[0].type = SU_NUMBER;
+	args[0].obj.num = 0.0;
+	
+	while (q->type != SU_NIL) {
+		if (q->type == LAZY_SEQ) {
+			*q = lazy_force(s, (lazy_seq_t*)q->obj.q);
+		} else if (q->type == CHUNK_SEQ && !kv) {
+			c = (chunk_seq_t*)q->obj.it.obj;
+			n = chunk_len(c);
+			for (i = q->obj.it.idx; i < n; i++) {
+				if (r->step(s, r, &c->node->data[i], 1))
+					return;
+			}
+			*q = seq_chunk_rest(s, q);
+		} else {
+			args[1] = seq_first(s, q);
+			if (kv ? r->step(s, r, args, 2) : r->step(s, r, &args[1], 1))
+				return;
+			args[0].obj.num += 1.0;
+			*q = seq_rest(s, q);
+		}
+	}
+}
+
+/* Functions are used as generators and called until they return nil, like (read -1) for lines. */
+static void reduce_generator(su_state *s, reducer_t *r, int gen) {
+	int stop;
+	for (;;) {
+		push_value(s, &s->stack[gen]);
+		su_call(s, 0, 1);
+		if (STK(-1)->type == SU_NIL) {
+			su_pop(s, 1);
+			return;
+		}
+		stop = r->step(s, r, STK(-1), 1);
+		su_pop(s, 1);
+		if (stop)
+			return;
+	}
+}
+
+/* The walks keep raw pointers into the collection across calls, so the heap is pinned. */
+static void fold(su_state *s, int idx, reducer_t *r, int kv) {
+	value_t coll = *STK(idx);
+	s->pinned++;
+	switch (coll.type) {
+		case SU_VECTOR:
+			reduce_vector(s, r, coll.obj.vec, kv);
+			break;
+		case SU_MAP:
+			reduce_map(s, r, coll.obj.m, kv);
+			break;
+		case SU_FUNCTION:
+		case SU_NATIVEFUNC:
+			su_assert(s, !kv, "Can't reduce-kv over a generator!");
+			reduce_generator(s, r, s->stack_top + idx);
+			break;
+		default:
+			if (coll.type == SU_STRING)
+				coll = it_create_string(s, coll.obj.str);
+			else if (coll.type != SU_NIL && !isseq(s, idx))
+				su_error(s, "Can't reduce object of type: %s", type_name((su_object_type_t)coll.type));
+			push_value(s, &coll);
+			reduce_seq(s, r, s->stack_top - 1, kv);
+			su_pop(s, 1);
+	}
+	s->pinned--;
+}
+
+static void reduce(su_state *s, int idx, int kv) {
+	reducer_t r;
+	r.step = &reduce_call;
+	r.func = s->stack_top - 2;
+	r.acc = s->stack_top - 1;
+	r.num_xf = 0;
+	r.edit = 0;
+	fold(s, idx, &r, kv);
+	push_value(s, &s->stack[r.acc]);
+}
+
+void su_reduce(su_state *s, int idx) {
+	reduce(s, idx, 0);
+}
+
+void su_reduce_kv(su_state *s, int idx) {
+	reduce(s, idx, 1);
+}
+
+void su_reduced(su_state *s) {
+	value_t v = reduced_create(s, STK(-1));
+	s->stack[s->stack_top - 1] = v;
+}
+
+void su_xform(su_state *s, su_xform_type_t kind) {
+	value_t v;
+	if (kind == SU_XF_TAKE || kind == SU_XF_DROP)
+		su_check_type(s, -1, SU_NUMBER);
+	v = xform_create(s, (int)kind, STK(-1));
+	s->stack[s->stack_top - 1] = v;
+}
+
+/* Returns zero if some stage lets nothing through, then the source is not touched at all. */
+static int transduce_init(su_state *s, reducer_t *r, int num) {
+	int i;
+	xform_t *x;
+	su_assert(s, num <= MAX_XFORMS, "Too many stages in pipeline!");
+	r->step = &transduce_step;
+	r->xf = s->stack_top - num;
+	r->num_xf = num;
+	for (i = 0; i < num; i++) {
+		su_assert(s, s->stack[r->xf + i].type == XFORM, "Expected a pipeline stage!");
+		x = (xform_t*)s->stack[r->xf + i].obj.gc_object;
+		r->count[i] = 0;
+		if (x->kind == SU_XF_TAKE && x->arg.obj.num < 1.0)
+			return 0;
+	}
+	return 1;
+}
+
+void su_transduce(su_state *s, int idx, int num) {
+	reducer_t r;
+	r.func = s->stack_top - num - 2;
+	r.acc = s->stack_top - num - 1;
+	r.edit = 0;
+	if (transduce_init(s, &r, num))
+		fold(s, idx, &r, 0);
+	push_value(s, &s->stack[r.acc]);
+}
+
+void su_into(su_state *s, int idx, int num) {
+	reducer_t r;
+	value_t box, acc = *STK(-num - 1);
+	int src = s->stack_top + idx;
+	su_assert(s, acc.type == SU_VECTOR || acc.type == SU_MAP, "Expected vector or map!");
+	
+	r.func = -1;
+	r.edit = transient_edit(s);
+	if (!transduce_init(s, &r, num)) {
+		push_value(s, &acc);
+		return;
+	}
+	
+	/* The edit is kept on the stack until the stamped nodes hold it. */
+	box.type = EDIT;
+	box.obj.gc_object = r.edit;
+	push_value(s, &box);
+	if (acc.type == SU_VECTOR)
+		acc = vector_transient(s, acc.obj.vec, r.edit);
+	else
+		acc = map_transient(s, acc.obj.m);
+	push_value(s, &acc);
+	r.acc = s->stack_top - 1;
+	fold(s, src - s->stack_top, &r, 0);
+	s->stack[s->stack_top - 2] = s->stack[s->stack_top - 1];
+	su_pop(s, 1);
+}
+
+void su_substring(su_state *s, int idx, int start, int end) {
+	value_t v;
+	string_t *str;
+	su_check_type(s, idx, SU_STRING);
+	str = STK(idx)->obj.str;
+	su_assert(s, start >= 0 && start <= end && end <= (int)string_len(str), "Substring out of range!");
+	v.type = SU_STRING;
+	v.obj.gc_object = string_slice(s, str, (unsigned)start, (unsigned)(end - start));
+	push_value(s, &v);
+}
+
+void su_string_builder(su_state *s) {
+	value_t v = builder_create(s);
+	push_value(s, &v);
+}
+
+/* Strings and ropes are appended as they are, anything else as it would be printed. */
+void su_string_append(su_state *s, int idx, int num) {
+	int i;
+	const char *str;
+	value_t *v;
+	builder_t *b;
+	/* The internal tags continue the public enum, so the cast is safe. */
+	su_check_type(s, idx, (su_object_type_t)STRING_BUILDER);
+	b = (builder_t*)STK(idx)->obj.gc_object;
+	for (i = num; i > 0; i--) {
+		v = STK(-i);
+		if (v->type == SU_STRING || v->type == ROPE) {
+			builder_append_text(s, b, v->obj.gc_object);
+		} else {
+			str = su_stringify(s, -i);
+			builder_append(s, b, str, (unsigned)strlen(str));
+		}
+	}
 	su_pop(s, num);
-	push_value(s, &vec);
+}
+
+static gc_t *get_text(su_state *s, int idx) {
+	su_assert(s, STK(idx)->type == SU_STRING || STK(idx)->type == ROPE, "Expected string or rope, but got %s.", type_name((su_object_type_t)STK(idx)->type));
+	return STK(idx)->obj.gc_object;
+}
+
+void su_rope(su_state *s, int num) {
+	int i;
+	value_t v;
+	gc_t *text;
+	if (num == 0) {
+		su_pushstring(s, "");
+		return;
+	}
+	text = get_text(s, -num);
+	for (i = num - 1; i > 0; i--)
+		text = rope_concat(s, text, get_text(s, -i));
+	su_pop(s, num);
+	v.type = text->type;
+	v.obj.gc_object = text;
+	push_value(s, &v);
+}
+
+int su_rope_length(su_state *s, int idx) {
+	return (int)text_length(get_text(s, idx));
+}
+
+void su_rope_slice(su_state *s, int idx, int start, int end) {
+	value_t v;
+	gc_t *text = get_text(s, idx);
+	su_assert(s, start >= 0 && start <= end && end <= (int)text_length(text), "Slice out of range!");
+	v.obj.gc_object = rope_slice(s, text, (unsigned)start, (unsigned)end);
+	v.type = v.obj.gc_object->type;
+	push_value(s, &v);
+}
+
+void su_flatten(su_state *s, int idx) {
+	value_t v;
+	builder_t *b;
+	if (STK(idx)->type == STRING_BUILDER) {
+		b = (builder_t*)STK(idx)->obj.gc_object;
+		su_pushbytes(s, b->buf, b->len);
+		return;
+	}
+	v.type = SU_STRING;
+	v.obj.gc_object = rope_flatten(s, get_text(s, idx));
+	push_value(s, &v);
 }
 
 void su_check_type(su_state *s, int idx, su_object_type_t t) {
@@ -651,12 +1722,15 @@ void su_check_type(su_state *s, int idx, su_object_type_t t) {
 
 void su_seterror(su_state *s, jmp_buf jmp, int flag) {
 	memcpy(s->err, jmp, sizeof(jmp_buf));
-	if (flag && s->errtop >= 0)
+	if (flag && s->errtop >= 0) {
 		s->stack_top = s->errtop;
-	else if (flag < 0)
+		s->frame_top = 0;
+		s->pinned = 0;
+	} else if (flag < 0) {
 		s->errtop = -1;
-	else
+	} else {
 		s->errtop = s->stack_top;
+	}
 }
 
 su_object_type_t su_type(su_state *s, int idx) {
@@ -665,14 +1739,12 @@ su_object_type_t su_type(su_state *s, int idx) {
 
 int su_getglobal(su_state *s, const char *name) {
 	value_t v;
-	unsigned size = strlen(name) + 1;
-	unsigned hash = murmur(name, size, 0);
+	unsigned size = strlen(name);
 
 	v.type = SU_STRING;
-	v.obj.gc_object = string_from_db(s, hash, size, name);
-	hash = hash_value(&v);
+	v.obj.gc_object = string_from_db(s, size, name);
 
-	v = map_get(s, s->globals.obj.m, &v, hash);
+	v = map_get(s, s->globals.obj.m, &v);
 	if (v.type == SU_INV)
 		return 0;
 
@@ -682,29 +1754,25 @@ int su_getglobal(su_state *s, const char *name) {
 
 void su_setglobal(su_state *s, int replace, const char *name) {
 	value_t v;
-	unsigned size = strlen(name) + 1;
-	unsigned hash = murmur(name, size, 0);
+	unsigned size = strlen(name);
 
 	v.type = SU_STRING;
-	v.obj.gc_object = string_from_db(s, hash, size, name);
-	hash = hash_value(&v);
+	v.obj.gc_object = string_from_db(s, size, name);
 
 	if (!replace)
-		su_assert(s, map_get(s, s->globals.obj.m, &v, hash).type == SU_INV, "Duplicated global!");
+		su_assert(s, map_get(s, s->globals.obj.m, &v).type == SU_INV, "Duplicated global!");
 
-	s->globals = map_insert(s, s->globals.obj.m, &v, hash, STK(-1));
+	s->globals = map_insert(s, s->globals.obj.m, &v, STK(-1));
 	update_global_ref(s);
 	su_pop(s, 1);
 }
 
 value_t create_value(su_state *s, const_t *constant) {
-	unsigned hash;
 	value_t v;
 	switch (constant->id) {
 		case CSTRING:
 			v.type = SU_STRING;
-			hash = murmur(constant->obj.str->str, constant->obj.str->size, 0);
-			v.obj.gc_object = string_from_db(s, hash, constant->obj.str->size, constant->obj.str->str);
+			v.obj.gc_object = string_from_db(s, constant->obj.str->size - 1, constant->obj.str->str);
 			break;
 		case CNUMBER:
 			v.type = SU_NUMBER;
@@ -736,7 +1804,7 @@ static const_string_t *read_string(su_state *s, reader_buffer_t *buffer) {
 	if (buffer_read(s, buffer, &size, sizeof(unsigned)))
 		return NULL;
 
-	str = su_allocate(s, NULL, sizeof(unsigned) + size);
+	str = mem_allocate(s, NULL, 0, sizeof(unsigned) + size, SU_ALLOC_STRING);
 	if (buffer_read(s, buffer, str->str, size))
 		return NULL;
 
@@ -752,12 +1820,12 @@ int read_prototype(su_state *s, reader_buffer_t *buffer, prototype_t *prot) {
 	assert(sizeof(instruction_t) == 4);
 
 	READ(&prot->num_inst, sizeof(unsigned));
-	prot->inst = su_allocate(s, NULL, sizeof(instruction_t) * prot->num_inst);
+	prot->inst = mem_allocate(s, NULL, 0, sizeof(instruction_t) * prot->num_inst, SU_ALLOC_CODE);
 	for (i = 0; i < prot->num_inst; i++)
 		READ(&prot->inst[i], sizeof(instruction_t));
 
 	READ(&prot->num_const, sizeof(unsigned));
-	prot->constants = su_allocate(s, NULL, sizeof(const_t) * prot->num_const);
+	prot->constants = mem_allocate(s, NULL, 0, sizeof(const_t) * prot->num_const, SU_ALLOC_CODE);
 	for (i = 0; i < prot->num_const; i++) {
 		READ(&prot->constants[i].id, sizeof(char));
 		switch (prot->constants[i].id) {
@@ -779,12 +1847,12 @@ int read_prototype(su_state *s, reader_buffer_t *buffer, prototype_t *prot) {
 	}
 
 	READ(&prot->num_ups, sizeof(unsigned));
-	prot->upvalues = su_allocate(s, NULL, sizeof(upvalue_t) * prot->num_ups);
+	prot->upvalues = mem_allocate(s, NULL, 0, sizeof(upvalue_t) * prot->num_ups, SU_ALLOC_CODE);
 	for (i = 0; i < prot->num_ups; i++)
 		READ(&prot->upvalues[i], sizeof(upvalue_t));
 
 	READ(&prot->num_prot, sizeof(unsigned));
-	prot->prot = su_allocate(s, NULL, sizeof(prototype_t) * prot->num_prot);
+	prot->prot = mem_allocate(s, NULL, 0, sizeof(prototype_t) * prot->num_prot, SU_ALLOC_CODE);
 	for (i = 0; i < prot->num_prot; i++) {
 		if (read_prototype(s, buffer, &prot->prot[i]))
 			goto error;
@@ -795,7 +1863,7 @@ int read_prototype(su_state *s, reader_buffer_t *buffer, prototype_t *prot) {
 		goto error;
 
 	READ(&prot->num_lineinf, sizeof(unsigned));
-	prot->lineinf = su_allocate(s, NULL, sizeof(int) * prot->num_lineinf);
+	prot->lineinf = mem_allocate(s, NULL, 0, sizeof(int) * prot->num_lineinf, SU_ALLOC_CODE);
 	for (i = 0; i < prot->num_lineinf; i++)
 		READ(&prot->lineinf[i], sizeof(unsigned));
 
@@ -808,17 +1876,40 @@ error:
 
 #undef READ
 
+static void free_const_string(su_state *s, const_string_t *str) {
+	if (str)
+		mem_allocate(s, str, sizeof(unsigned) + str->size, 0, SU_ALLOC_STRING);
+}
+
+void free_prototype(su_state *s, prototype_t *prot) {
+	int i;
+	mem_allocate(s, prot->inst, sizeof(instruction_t) * prot->num_inst, 0, SU_ALLOC_CODE);
+	mem_allocate(s, prot->lineinf, sizeof(int) * prot->num_lineinf, 0, SU_ALLOC_CODE);
+	mem_allocate(s, prot->upvalues, sizeof(upvalue_t) * prot->num_ups, 0, SU_ALLOC_CODE);
+	
+	for (i = 0; i < prot->num_const; i++) {
+		if (prot->constants[i].id == CSTRING)
+			free_const_string(s, prot->constants[i].obj.str);
+	}
+	mem_allocate(s, prot->constants, sizeof(const_t) * prot->num_const, 0, SU_ALLOC_CODE);
+	
+	for (i = 0; i < prot->num_prot; i++)
+		free_prototype(s, &prot->prot[i]);
+	mem_allocate(s, prot->prot, sizeof(prototype_t) * prot->num_prot, 0, SU_ALLOC_CODE);
+	free_const_string(s, prot->name);
+}
+
 void lambda(su_state *s, prototype_t *prot, int narg) {
 	unsigned i, tmp;
 	value_t v;
-	function_t *func = su_allocate(s, NULL, sizeof(function_t));
+	function_t *func = (function_t*)gc_allocate_old(s, sizeof(function_t), SU_FUNCTION);
 
 	func->narg = narg;
 	func->prot = prot;
 	func->num_const = prot->num_const;
 	func->num_ups = prot->num_ups;
-	func->constants = su_allocate(s, NULL, sizeof(value_t) * prot->num_const);
-	func->upvalues = su_allocate(s, NULL, sizeof(value_t) * prot->num_ups);
+	func->constants = mem_allocate(s, NULL, 0, sizeof(value_t) * prot->num_const, SU_ALLOC_CODE);
+	func->upvalues = mem_allocate(s, NULL, 0, sizeof(value_t) * prot->num_ups, SU_ALLOC_CODE);
 
 	for (i = 0; i < func->num_const; i++)
 		func->constants[i] = create_value(s, &prot->constants[i]);
@@ -829,14 +1920,14 @@ void lambda(su_state *s, prototype_t *prot, int narg) {
 		func->upvalues[i] = s->stack[tmp];
 	}
 
-	gc_insert_object(s, (gc_t*)func, SU_FUNCTION);
 	v.type = SU_FUNCTION;
 	v.obj.func = func;
 	push_value(s, &v);
 }
 
 int su_load(su_state *s, su_reader reader, void *data) {
-	prototype_t *prot = su_allocate(s, NULL, sizeof(prototype_t));
+	gc_t header;
+	prototype_t tmp, *prot;
 	reader_buffer_t *buffer = buffer_open(s, reader, data);
 
 	if (verify_header(s, buffer)) {
@@ -844,13 +1935,17 @@ int su_load(su_state *s, su_reader reader, void *data) {
 		return -1;
 	}
 
-	if (read_prototype(s, buffer, prot)) {
+	if (read_prototype(s, buffer, &tmp)) {
 		buffer_close(s, buffer);
 		return -1;
 	}
 
 	buffer_close(s, buffer);
-	gc_insert_object(s, &prot->gc, PROTOTYPE);
+	/* PROTOTYPE is an internal tag that continues the public enum. */
+	prot = (prototype_t*)gc_allocate_old(s, sizeof(prototype_t), (su_object_type_t)PROTOTYPE);
+	header = prot->gc;
+	*prot = tmp;
+	prot->gc = header;
 	lambda(s, prot, -1);
 	return 0;
 }
@@ -858,7 +1953,7 @@ int su_load(su_state *s, su_reader reader, void *data) {
 static void check_args(su_state *s, va_list arg, int start, int num) {
 	int i;
 	su_object_type_t a, b;
-	for (i = start; i - num > 0; i--) {
+	for (i = start; i > start - num; i--) {
 		a = su_type(s, -i);
 		b = va_arg(arg, su_object_type_t);
 		if (b != SU_NIL)
@@ -950,12 +2045,8 @@ static void vm_loop(su_state *s, function_t *func) {
 				STK(-1)->obj.num = -STK(-1)->obj.num;
 				break;
 			case OP_EQ:
-				if (STK(-2)->type != STK(-1)->type)
-					STK(-2)->obj.b = false;
-				else if (STK(-2)->type == SU_NUMBER)
-					STK(-2)->obj.b = STK(-2)->obj.num == STK(-1)->obj.num;
-				else
-					STK(-2)->obj.b = STK(-2)->obj.ptr == STK(-1)->obj.ptr;
+				tmp = value_eq(STK(-2), STK(-1));
+				STK(-2)->obj.b = tmp;
 				STK(-2)->type = SU_BOOLEAN;
 				su_pop(s, 1);
 				break;
@@ -1007,7 +2098,7 @@ static void vm_loop(su_state *s, function_t *func) {
 				s->prot = s->frame->func->prot;
 				func = s->frame->func;
 
-				memcpy(&s->stack[s->frame->stack_top], &s->stack[s->stack_top - (inst.a + 1)], sizeof(value_t) * (inst.a + 1));
+				memmove(&s->stack[s->frame->stack_top], &s->stack[s->stack_top - (inst.a + 1)], sizeof(value_t) * (inst.a + 1));
 				s->stack_top = s->frame->stack_top + inst.a + 1;
 				s->frame_top--;
 				s->frame = FRAME();
@@ -1064,7 +2155,7 @@ static void vm_loop(su_state *s, function_t *func) {
 						su_error(s, "Expected at least one argument!");
 					} else if (inst.a == 1) {
 						tmpv = *STK(-1);
-						tmpv = map_get(s, s->stack[tmp].obj.m, &tmpv, hash_value(&tmpv));
+						tmpv = map_get(s, s->stack[tmp].obj.m, &tmpv);
 						su_assert(s, tmpv.type != SU_INV, "No value with that key!");
 						su_pop(s, 2);
 						push_value(s, &tmpv);
@@ -1082,7 +2173,7 @@ static void vm_loop(su_state *s, function_t *func) {
 			case OP_GETGLOBAL:
 				tmpv = func->constants[inst.a];
 				su_assert(s, tmpv.type == SU_STRING, "Global key must be a string!");
-				tmpv = map_get(s, s->globals.obj.m, &tmpv, hash_value(&tmpv));
+				tmpv = map_get(s, s->globals.obj.m, &tmpv);
 				if (tmpv.type == SU_INV)
 					global_error(s, "Can't access global variable", &func->constants[inst.a]);
 				push_value(s, &tmpv);
@@ -1090,11 +2181,10 @@ static void vm_loop(su_state *s, function_t *func) {
 			case OP_SETGLOBAL:
 				tmpv = func->constants[inst.a];
 				su_assert(s, tmpv.type == SU_STRING, "Global key must be a string!");
-				i = hash_value(&tmpv);
-				if (map_get(s, s->globals.obj.m, &tmpv, i).type != SU_INV)
+				if (map_get(s, s->globals.obj.m, &tmpv).type != SU_INV)
 					global_error(s, "Redefinition of global variable", &tmpv);
 
-				s->globals = map_insert(s, s->globals.obj.m, &tmpv, i, STK(-1));
+				s->globals = map_insert(s, s->globals.obj.m, &tmpv, STK(-1));
 				update_global_ref(s);
 				break;
 			case OP_LOAD:
@@ -1127,7 +2217,14 @@ void su_call(su_state *s, int narg, int nret) {
 	s->narg = narg;
 
 	if (f->type == SU_FUNCTION) {
-		su_assert(s, f->obj.func->narg < 0 || f->obj.func->narg == narg, "Bad number of argument to function!");
+		if (f->obj.func->narg < 0)
+			push_varg(s, narg);
+		else
+			su_assert(s, f->obj.func->narg == narg, "Bad number of argument to function!");
+		
+		su_assert(s, s->stack_top + f->obj.func->num_ups <= STACK_SIZE, "Stack overflow!");
+		memcpy(&s->stack[s->stack_top], f->obj.func->upvalues, sizeof(value_t) * f->obj.func->num_ups);
+		s->stack_top += f->obj.func->num_ups;
 		vm_loop(s, f->obj.func);
 		if (nret == 0)
 			su_pop(s, 1);
@@ -1135,7 +2232,7 @@ void su_call(su_state *s, int narg, int nret) {
 		fret = f->obj.nfunc(s, narg);
 		if (nret > 0 && fret > 0) {
 			s->stack[top] = *STK(-1);
-			su_pop(s, narg);
+			s->stack_top = top + 1;
 		} else {
 			s->stack_top = top;
 			if (nret > 0)
@@ -1175,20 +2272,21 @@ void su_set_stderr(su_state *s, FILE *fp) {
 	s->fstderr = fp;
 }
 
-static void *default_alloc(void *ptr, size_t size) {
-	if (size) return realloc(ptr, size);
+static void *default_alloc(void *ud, void *ptr, size_t osize, size_t nsize, su_alloc_type_t type) {
+	if (nsize) return realloc(ptr, nsize);
 	free(ptr);
 	return NULL;
 }
 
-su_state *su_init(su_alloc alloc) {
+su_state *su_init(su_alloc alloc, void *ud) {
 	su_alloc mf = alloc ? alloc : default_alloc;
-	su_state *s = (su_state*)mf(NULL, sizeof(su_state));
+	su_state *s = (su_state*)mf(ud, NULL, 0, sizeof(su_state), SU_ALLOC_STATE);
+	if (!s)
+		return NULL;
 	s->alloc = mf;
+	s->alloc_ud = ud;
 
-	s->num_objects = 0;
-	s->gc_gray_size = 0;
-	s->gc_root = NULL;
+	gc_init(s);
 
 	s->fstdin = stdin;
 	s->fstdout = stdout;
@@ -1196,6 +2294,7 @@ su_state *su_init(su_alloc alloc) {
 
 	s->stack_top = 0;
 	s->frame_top = 0;
+	s->pinned = 0;
 	s->narg = 0;
 	s->pc = 0xffff;
 	s->interupt = 0x0;
@@ -1206,7 +2305,11 @@ su_state *su_init(su_alloc alloc) {
 
 	s->errtop = -1;
 
-	s->strings = map_create_empty(s);
+	s->strings = NULL;
+	s->strings_cap = 0;
+	s->strings_cnt = 0;
+	s->strings_used = 0;
+	memset(s->chars, 0, sizeof(s->chars));
 	s->globals = map_create_empty(s);
 	update_global_ref(s);
 	return s;
@@ -1215,12 +2318,13 @@ su_state *su_init(su_alloc alloc) {
 void su_close(su_state *s) {
 	s->stack_top = 0;
 	s->globals.type = SU_NIL;
-	s->strings.type = SU_NIL;
 	su_gc(s);
+	mem_allocate(s, s->strings, sizeof(string_t*) * s->strings_cap, 0, SU_ALLOC_STATE);
+	gc_close(s);
 
 	if (s->fstdin != stdin) fclose(s->fstdin);
 	if (s->fstdout != stdout) fclose(s->fstdout);
 	if (s->fstderr != stderr) fclose(s->fstderr);
 
-	s->alloc(s, 0);
+	s->alloc(s->alloc_ud, s, sizeof(su_state), 0, SU_ALLOC_STATE);
 }
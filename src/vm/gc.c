@@ -26,19 +26,271 @@
 #include "seq.h"
 #include "ref.h"
 #include "gc.h"
+#include "thread.h"
 
+#include <string.h>
 #include <assert.h>
 
-static void free_prot(su_state *s, prototype_t *prot);
+#define nursery_size(n) (((n) + NURSERY_ALIGN - 1) & ~(size_t)(NURSERY_ALIGN - 1))
+#define NURSERY_MARKS_SIZE (NURSERY_SIZE / NURSERY_ALIGN / 8)
+#define forward(obj) (*(gc_t**)((obj) + 1))
 
-static void add_to_gray(su_state *s, gc_t *obj) {
-	if (obj->flags != GC_FLAG_WHITE)
+#define page_of(obj) ((page_t*)((size_t)(obj) & ~(size_t)(GC_PAGE_SIZE - 1)))
+#define page_first(p) ((char*)(p) + ((sizeof(page_t) + GC_PAGE_GRANULE - 1) & ~(size_t)(GC_PAGE_GRANULE - 1)))
+#define large_of(obj) ((large_t*)(obj) - 1)
+/* One page extra so the pages can be aligned. */
+#define SEGMENT_SIZE (GC_PAGE_SIZE * (GC_SEGMENT_PAGES + 1))
+#define page_object(p, i) ((gc_t*)((char*)(p) + (i) * GC_PAGE_GRANULE))
+#define page_slots(p) ((unsigned)(((char*)(p) + GC_PAGE_SIZE - page_first(p)) / (p)->size))
+
+/* Pages with free slots are kept in a list per size class. Slots that were never used are taken from top. */
+struct page {
+	page_t *next;
+	page_t *next_avail, *prev_avail;
+	segment_t *seg;
+	gc_t *free;
+	char *top;
+	unsigned size;
+	unsigned cls;
+	unsigned used;
+	unsigned epoch;
+	int avail;
+	unsigned alloc[GC_PAGE_BITMAP_WORDS];
+	unsigned marks[GC_PAGE_BITMAP_WORDS];
+};
+
+struct segment {
+	segment_t *next;
+	void *mem;
+	char *base;
+	unsigned free;
+	size_t live;
+	int evacuating;
+};
+
+/* Objects bigger than the largest size class are allocated one by one. */
+struct large {
+	large_t *next;
+	size_t size;
+	unsigned marked;
+};
+
+static const unsigned short size_classes[GC_SIZE_CLASSES] = {
+	16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 192,
+	224, 256, 272, 320, 384, 448, 528, 640, 768, 1024, 1280, 1536, 2048
+};
+
+typedef void (*visit_t)(su_state *s, gc_t **ref, void *ud);
+
+static page_t *sweep_class(su_state *s, unsigned cls);
+
+static unsigned lowest_bit(unsigned mask) {
+	#ifdef __GNUC__
+		return (unsigned)__builtin_ctz(mask);
+	#else
+		unsigned i;
+		for (i = 0; !(mask & 1); i++)
+			mask >>= 1;
+		return i;
+	#endif
+}
+
+/* --------------------------------- Mark bits --------------------------------- */
+
+/* Young objects have their mark bits in a bitmap covering the nursery. */
+static unsigned *mark_word(su_state *s, gc_t *obj, unsigned *bit) {
+	size_t i;
+	page_t *p;
+	if (obj->gen == GC_GEN_YOUNG) {
+		i = (size_t)((char*)obj - s->nursery) / NURSERY_ALIGN;
+		*bit = 1u << (i & 31);
+		return &s->nursery_marks[i >> 5];
+	}
+	p = page_of(obj);
+	i = (size_t)((char*)obj - (char*)p) / GC_PAGE_GRANULE;
+	*bit = 1u << (i & 31);
+	return &p->marks[i >> 5];
+}
+
+int gc_marked(su_state *s, gc_t *obj) {
+	unsigned bit;
+	if (obj->flags & GC_FLAG_LARGE)
+		return large_of(obj)->marked;
+	return (*mark_word(s, obj, &bit) & bit) != 0;
+}
+
+/* Returns non-zero if the object was not marked before. */
+static int set_mark(su_state *s, gc_t *obj) {
+	unsigned bit, *word;
+	if (obj->flags & GC_FLAG_LARGE) {
+		if (large_of(obj)->marked)
+			return 0;
+		large_of(obj)->marked = 1;
+		return 1;
+	}
+	word = mark_word(s, obj, &bit);
+	if (*word & bit)
+		return 0;
+	*word |= bit;
+	return 1;
+}
+
+/* --------------------------------- Page heap --------------------------------- */
+
+static void avail_insert(su_state *s, page_t *p) {
+	page_t **head = &s->pages_avail[p->cls];
+	p->prev_avail = NULL;
+	p->next_avail = *head;
+	if (*head)
+		(*head)->prev_avail = p;
+	*head = p;
+	p->avail = 1;
+}
+
+static void avail_remove(su_state *s, page_t *p) {
+	if (p->prev_avail)
+		p->prev_avail->next_avail = p->next_avail;
+	else
+		s->pages_avail[p->cls] = p->next_avail;
+	if (p->next_avail)
+		p->next_avail->prev_avail = p->prev_avail;
+	p->avail = 0;
+}
+
+static page_t *page_create(su_state *s, unsigned cls) {
+	unsigned i;
+	page_t *p;
+	segment_t *seg;
+	
+	for (seg = s->segments; seg && (!seg->free || seg->evacuating); seg = seg->next);
+	if (!seg) {
+		seg = (segment_t*)mem_allocate(s, NULL, 0, sizeof(segment_t), SU_ALLOC_HEAP);
+		seg->mem = mem_allocate(s, NULL, 0, SEGMENT_SIZE, SU_ALLOC_HEAP);
+		seg->base = (char*)(((size_t)seg->mem + GC_PAGE_SIZE - 1) & ~(size_t)(GC_PAGE_SIZE - 1));
+		seg->free = ~0u;
+		seg->evacuating = 0;
+		seg->next = s->segments;
+		s->segments = seg;
+	}
+	
+	i = lowest_bit(seg->free);
+	seg->free &= ~(1u << i);
+	p = (page_t*)(seg->base + GC_PAGE_SIZE * i);
+	p->seg = seg;
+	p->free = NULL;
+	p->top = page_first(p);
+	p->size = size_classes[cls];
+	p->cls = cls;
+	p->used = 0;
+	p->epoch = s->gc_epoch;
+	memset(p->alloc, 0, sizeof(p->alloc));
+	memset(p->marks, 0, sizeof(p->marks));
+	
+	p->next = s->pages[cls];
+	s->pages[cls] = p;
+	avail_insert(s, p);
+	return p;
+}
+
+static void page_release(su_state *s, page_t *p) {
+	segment_t **l;
+	segment_t *seg = p->seg;
+	if (p->avail)
+		avail_remove(s, p);
+	seg->free |= 1u << ((char*)p - seg->base) / GC_PAGE_SIZE;
+	if (seg->free != ~0u)
 		return;
-	assert(s->gc_gray_size <= GC_GRAY_SIZE);
-	obj->flags = GC_FLAG_GRAY;
+	
+	for (l = &s->segments; *l != seg; l = &(*l)->next);
+	*l = seg->next;
+	mem_allocate(s, seg->mem, SEGMENT_SIZE, 0, SU_ALLOC_HEAP);
+	mem_allocate(s, seg, sizeof(segment_t), 0, SU_ALLOC_HEAP);
+}
+
+static gc_t *heap_allocate(su_state *s, size_t size) {
+	unsigned i;
+	page_t *p;
+	gc_t *obj;
+	large_t *l;
+	unsigned cls;
+	
+	if (size > GC_SIZE_CLASS_MAX) {
+		l = (large_t*)mem_allocate(s, NULL, 0, sizeof(large_t) + size, SU_ALLOC_LARGE);
+		l->next = s->large;
+		l->size = size;
+		/* Only a sweep that has not started on the large objects will see it. */
+		l->marked = s->gc_state == GC_STATE_SWEEP && s->gc_sweep_large == &s->large;
+		s->large = l;
+		s->gc_bytes += size;
+		obj = (gc_t*)(l + 1);
+		obj->flags = GC_FLAG_LARGE;
+		return obj;
+	}
+	
+	cls = s->size_class[(size + GC_PAGE_GRANULE - 1) / GC_PAGE_GRANULE];
+	p = s->pages_avail[cls];
+	if (!p && s->gc_state == GC_STATE_SWEEP)
+		p = sweep_class(s, cls);
+	if (!p)
+		p = page_create(s, cls);
+	if (p->free) {
+		obj = p->free;
+		p->free = *(gc_t**)obj;
+	} else {
+		obj = (gc_t*)p->top;
+		p->top += p->size;
+	}
+	if (!p->free && p->top + p->size > (char*)p + GC_PAGE_SIZE)
+		avail_remove(s, p);
+	p->used++;
+	s->gc_bytes += p->size;
+	
+	i = (unsigned)(((char*)obj - (char*)p) / GC_PAGE_GRANULE);
+	p->alloc[i >> 5] |= 1u << (i & 31);
+	/* A page the sweep has not reached yet would take the object for garbage. */
+	if (s->gc_state == GC_STATE_SWEEP && p->epoch != s->gc_epoch)
+		p->marks[i >> 5] |= 1u << (i & 31);
+	obj->flags = 0;
+	return obj;
+}
+
+/* --------------------------------- Gray stack and remembered set --------------------------------- */
+
+static void push_gray(su_state *s, gc_t *obj) {
+	if (s->gc_gray_size == s->gc_gray_cap) {
+		s->gc_gray = (gc_t**)mem_allocate(s, s->gc_gray, sizeof(gc_t*) * s->gc_gray_cap, sizeof(gc_t*) * s->gc_gray_cap * 2, SU_ALLOC_STATE);
+		s->gc_gray_cap *= 2;
+	}
 	s->gc_gray[s->gc_gray_size++] = obj;
 }
 
+static void add_to_gray(su_state *s, gc_t *obj) {
+	if (set_mark(s, obj))
+		push_gray(s, obj);
+}
+
+/* A marked object that is written to is traced again, so it can not hide an unmarked one. */
+void gc_regray(su_state *s, gc_t *obj) {
+	if (gc_marked(s, obj))
+		push_gray(s, obj);
+}
+
+static void push_remembered(su_state *s, gc_t *obj) {
+	if (s->gc_remembered_size == s->gc_remembered_cap) {
+		s->gc_remembered = (gc_t**)mem_allocate(s, s->gc_remembered, sizeof(gc_t*) * s->gc_remembered_cap, sizeof(gc_t*) * s->gc_remembered_cap * 2, SU_ALLOC_STATE);
+		s->gc_remembered_cap *= 2;
+	}
+	s->gc_remembered[s->gc_remembered_size++] = obj;
+}
+
+/* An old object that is written to may point into the nursery, it is scanned by the next young collection. */
+void gc_remember(su_state *s, gc_t *obj) {
+	obj->gen = GC_GEN_REMEMBERED;
+	push_remembered(s, obj);
+}
+
+/* --------------------------------- Traversal --------------------------------- */
+
 static gc_t *get_gc_object(value_t *v) {
 	switch (v->type) {
 		case SU_INV:
@@ -52,177 +304,1060 @@ static gc_t *get_gc_object(value_t *v) {
 	return v->obj.gc_object;
 }
 
-static void gray_vector(su_state *s, gc_t *obj) {
-	vector_t *v = (vector_t*)obj;
-	add_to_gray(s, (gc_t*)v->root);
-	add_to_gray(s, (gc_t*)v->tail);
+static void visit_value(su_state *s, value_t *v, visit_t visit, void *ud) {
+	if (get_gc_object(v))
+		visit(s, &v->obj.gc_object, ud);
 }
 
-static void gray_vector_node(su_state *s, gc_t *obj) {
+static void visit_values(su_state *s, value_t *v, int num, visit_t visit, void *ud) {
 	int i;
-	gc_t *child;
-	vector_node_t *node = (vector_node_t*)obj;
-	for (i = 0; i < (int)node->len; i++) {
-		child = get_gc_object(&node->data[i]);
-		if (child) add_to_gray(s, child);
-	}
+	for (i = 0; i < num; i++)
+		visit_value(s, &v[i], visit, ud);
 }
 
-static void gray_function(su_state *s, gc_t *obj) {
-	int i;
-	gc_t *child;
-	function_t *func = (function_t*)obj;
-	if (func->prot->gc.type != SU_INV)
-		add_to_gray(s, &func->prot->gc);
-	for (i = 0; i < (int)func->num_const; i++) {
-		child = get_gc_object(&func->constants[i]);
-		if (child) add_to_gray(s, child);
-	}
-	for (i = 0; i < (int)func->num_ups; i++) {
-		child = get_gc_object(&func->upvalues[i]);
-		if (child) add_to_gray(s, child);
-	}
+typedef struct {
+	visit_t visit;
+	void *ud;
+} data_visit_t;
+
+static void visit_data(su_state *s, su_value *v, void *ctx) {
+	visit_value(s, (value_t*)v, ((data_visit_t*)ctx)->visit, ((data_visit_t*)ctx)->ud);
 }
 
-static void free_prot(su_state *s, prototype_t *prot) {
-	int i;
-	su_allocate(s, prot->inst, 0);
-	su_allocate(s, prot->lineinf, 0);
-	su_allocate(s, prot->upvalues, 0);
-	
-	for (i = 0; i < prot->num_const; i++) {
-		if (prot->constants[i].id == CSTRING)
-			su_allocate(s, prot->constants[i].obj.str, 0);
+/* Calls visit with every reference the object holds, the reference may be replaced. */
+static void traverse(su_state *s, gc_t *obj, visit_t visit, void *ud) {
+	function_t *func;
+	native_data_t *data;
+	data_visit_t ctx;
+	switch (obj->type) {
+		case SU_LOCAL:
+			visit_value(s, &((local_t*)obj)->v, visit, ud);
+			break;
+		case SU_WEAK:
+			visit_value(s, &((weak_t*)obj)->v, visit, ud);
+			break;
+		case SU_NATIVEDATA:
+			data = (native_data_t*)obj;
+			if (data->vt && data->vt->trace) {
+				ctx.visit = visit;
+				ctx.ud = ud;
+				data->vt->trace(s, data->data, visit_data, &ctx);
+			}
+			break;
+		case SU_EPHEMERON:
+			visit_values(s, ((ephemeron_t*)obj)->slots, (int)((ephemeron_t*)obj)->cap * 2, visit, ud);
+			break;
+		case SU_VECTOR:
+			visit(s, (gc_t**)&((vector_t*)obj)->root, ud);
+			visit(s, (gc_t**)&((vector_t*)obj)->tail, ud);
+			break;
+		case VECTOR_NODE:
+			if (((vector_node_t*)obj)->edit)
+				visit(s, &((vector_node_t*)obj)->edit, ud);
+			visit_values(s, ((vector_node_t*)obj)->data, ((vector_node_t*)obj)->len, visit, ud);
+			break;
+		case SU_FUNCTION:
+			func = (function_t*)obj;
+			if (func->prot->gc.type != SU_INV)
+				visit(s, (gc_t**)&func->prot, ud);
+			visit_values(s, func->constants, (int)func->num_const, visit, ud);
+			visit_values(s, func->upvalues, (int)func->num_ups, visit, ud);
+			break;
+		case SU_MAP:
+			visit(s, (gc_t**)&((map_t*)obj)->root, ud);
+			break;
+		case MAP_NODE:
+		case MAP_COLLISION:
+		case MAP_ARRAY:
+			if (((node_t*)obj)->edit)
+				visit(s, &((node_t*)obj)->edit, ud);
+			visit_values(s, ((node_t*)obj)->slots, ((node_t*)obj)->len, visit, ud);
+			break;
+		case CELL_SEQ:
+			visit_value(s, &((cell_seq_t*)obj)->first, visit, ud);
+			visit_value(s, &((cell_seq_t*)obj)->rest, visit, ud);
+			break;
+		case LAZY_SEQ:
+			visit_value(s, &((lazy_seq_t*)obj)->thunk, visit, ud);
+			visit_value(s, &((lazy_seq_t*)obj)->seq, visit, ud);
+			break;
+		case CHUNK_SEQ:
+			visit(s, (gc_t**)&((chunk_seq_t*)obj)->vec, ud);
+			visit(s, (gc_t**)&((chunk_seq_t*)obj)->node, ud);
+			break;
+		case SU_TRANSIENT:
+			if (((transient_t*)obj)->edit)
+				visit(s, &((transient_t*)obj)->edit, ud);
+			visit_value(s, &((transient_t*)obj)->coll, visit, ud);
+			break;
+		case REDUCED:
+			visit_value(s, &((reduced_t*)obj)->val, visit, ud);
+			break;
+		case XFORM:
+			visit_value(s, &((xform_t*)obj)->arg, visit, ud);
+			break;
+		case SU_STRING:
+			if (((string_t*)obj)->parent)
+				visit(s, &((string_t*)obj)->parent, ud);
+			break;
+		case ROPE:
+			visit(s, &((rope_t*)obj)->left, ud);
+			visit(s, &((rope_t*)obj)->right, ud);
+			break;
 	}
-	su_allocate(s, prot->constants, 0);
-	
-	for (i = 0; i < prot->num_prot; i++)
-		free_prot(s, &prot->prot[i]);
-	su_allocate(s, prot->prot, 0);
 }
 
+/* The size is asked for first, the finalizer is likely to free what it measures. */
+static void free_data(su_state *s, native_data_t *data) {
+	if (!data->vt)
+		return;
+	if (data->vt->size)
+		su_external_memory(s, -(long)data->vt->size(s, data->data));
+	if (data->vt->finalize)
+		data->vt->finalize(s, data->data);
+}
+
+/* Frees what the object owns outside the heap, the object itself is freed by the sweep. */
 static void free_object(su_state *s, gc_t *obj) {
 	function_t *func;
 	if (obj->type == SU_FUNCTION) {
 		func = (function_t*)obj;
-		su_allocate(s, func->constants, 0);
-		su_allocate(s, func->upvalues, 0);
+		mem_allocate(s, func->constants, sizeof(value_t) * func->num_const, 0, SU_ALLOC_CODE);
+		mem_allocate(s, func->upvalues, sizeof(value_t) * func->num_ups, 0, SU_ALLOC_CODE);
 	} else if (obj->type == PROTOTYPE) {
-		free_prot(s, (prototype_t*)obj);
+		free_prototype(s, (prototype_t*)obj);
+	} else if (obj->type == SU_STRING) {
+		if (((string_t*)obj)->flags & STRING_DETACHED)
+			mem_allocate(s, ((string_t*)obj)->str, ((string_t*)obj)->size + 1, 0, SU_ALLOC_STRING);
+	} else if (obj->type == STRING_BUILDER && ((builder_t*)obj)->buf) {
+		mem_allocate(s, ((builder_t*)obj)->buf, ((builder_t*)obj)->cap, 0, SU_ALLOC_STRING);
+	} else if (obj->type == SU_EPHEMERON) {
+		mem_allocate(s, ((ephemeron_t*)obj)->slots, sizeof(value_t) * 2 * ((ephemeron_t*)obj)->cap, 0, SU_ALLOC_STATE);
+	} else if (obj->type == SU_NATIVEDATA) {
+		free_data(s, (native_data_t*)obj);
 	} else if (obj->type == SU_LOCAL) {
 		/* Remove from the local registry. */
 	}
-	su_allocate(s, obj, 0);
 }
 
-static void begin(su_state *s) {
+gc_t *gc_allocate_old(su_state *s, size_t size, su_object_type_t type) {
+	gc_t *obj = heap_allocate(s, size);
+	obj->type = (unsigned char)type;
+	obj->gen = GC_GEN_OLD;
+	obj->id = 0;
+	s->interupt |= IGC;
+	
+	/* The object is filled in after this and may end up pointing into the nursery. */
+	if (obj->type != SU_STRING && obj->type != PROTOTYPE && obj->type != STRING_BUILDER)
+		gc_remember(s, obj);
+	return obj;
+}
+
+/* --------------------------------- Young collection --------------------------------- */
+
+/* Only the types allocated with gc_allocate can be young. */
+static size_t object_size(gc_t *obj) {
+	switch (obj->type) {
+		case SU_VECTOR:
+			return sizeof(vector_t);
+		case VECTOR_NODE:
+			return sizeof(vector_node_t) + sizeof(value_t) * ((vector_node_t*)obj)->cap - sizeof(value_t);
+		case SU_MAP:
+			return sizeof(map_t);
+		case MAP_NODE:
+		case MAP_COLLISION:
+		case MAP_ARRAY:
+			return sizeof(node_t) + sizeof(value_t) * (((node_t*)obj)->cap - 1);
+		case CELL_SEQ:
+			return sizeof(cell_seq_t);
+		case LAZY_SEQ:
+			return sizeof(lazy_seq_t);
+		case CHUNK_SEQ:
+			return sizeof(chunk_seq_t);
+		case SU_TRANSIENT:
+			return sizeof(transient_t);
+		case REDUCED:
+			return sizeof(reduced_t);
+		case XFORM:
+			return sizeof(xform_t);
+		case ROPE:
+			return sizeof(rope_t);
+		case EDIT:
+			return sizeof(edit_t);
+	}
+	assert(0);
+	return 0;
+}
+
+gc_t *gc_allocate(su_state *s, size_t size, su_object_type_t type) {
+	gc_t *obj;
+	size_t n = nursery_size(size);
+	if (n <= NURSERY_OBJECT_MAX && n <= (size_t)(s->nursery_end - s->nursery_top)) {
+		obj = (gc_t*)s->nursery_top;
+		s->nursery_top += n;
+		obj->type = (unsigned char)type;
+		obj->flags = 0;
+		obj->gen = GC_GEN_YOUNG;
+		obj->id = 0;
+		return obj;
+	}
+	/* The heap allocation asks for a collection, so a full nursery is emptied at the next instruction. */
+	return gc_allocate_old(s, size, type);
+}
+
+/* Copies a young object to the heap and leaves its new address behind. */
+static gc_t *promote(su_state *s, gc_t *obj) {
+	size_t size = object_size(obj);
+	int marked = s->gc_state == GC_STATE_MARK && gc_marked(s, obj);
+	gc_t *copy = heap_allocate(s, size);
+	unsigned char flags = copy->flags;
+	
+	memcpy(copy, obj, size);
+	copy->flags = flags;
+	copy->gen = GC_GEN_OLD;
+	/* A copy made while marking keeps its mark, a gray one is fixed on the gray stack. */
+	if (marked)
+		set_mark(s, copy);
+	
+	obj->gen = GC_GEN_FORWARDED;
+	forward(obj) = copy;
+	push_remembered(s, copy);
+	return copy;
+}
+
+static void promote_ref(su_state *s, gc_t **ref, void *ud) {
+	gc_t *obj = *ref;
+	if (obj->gen == GC_GEN_FORWARDED)
+		*ref = forward(obj);
+	else if (obj->gen == GC_GEN_YOUNG)
+		*ref = promote(s, obj);
+}
+
+/*
+	Natives that call back into the VM may hold pointers to young objects,
+	so they can only be moved when no such call is in progress. The first
+	frame is the call made by the host, the API functions that call back
+	while walking a collection pin the heap instead.
+*/
+static int in_native(su_state *s) {
+	int i;
+	if (s->pinned)
+		return 1;
+	for (i = 1; i < s->frame_top; i++) {
+		if (s->frames[i].ret_addr == 0xffff)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+	The young objects that can be reached from the roots or from remembered
+	objects are copied to the heap and become old, everything else in the
+	nursery is dead. Copies are added to the remembered set, so they are
+	scanned in turn.
+*/
+static void minor(su_state *s) {
+	unsigned i, j;
+	gc_t *obj;
+	
+	for (i = 0; i < (unsigned)s->stack_top; i++)
+		visit_value(s, &s->stack[i], promote_ref, NULL);
+	visit_value(s, &s->globals, promote_ref, NULL);
+	
+	for (i = 0; i < s->gc_remembered_size; i++) {
+		obj = s->gc_remembered[i];
+		traverse(s, obj, promote_ref, NULL);
+		obj->gen = GC_GEN_OLD;
+	}
+	s->gc_remembered_size = 0;
+	
+	/* Gray young objects were either copied or are dead. */
+	for (i = j = 0; i < s->gc_gray_size; i++) {
+		obj = s->gc_gray[i];
+		if (obj->gen == GC_GEN_FORWARDED)
+			s->gc_gray[j++] = forward(obj);
+		else if (obj->gen != GC_GEN_YOUNG)
+			s->gc_gray[j++] = obj;
+	}
+	s->gc_gray_size = j;
+	
+	s->nursery_top = s->nursery;
+	memset(s->nursery_marks, 0, NURSERY_MARKS_SIZE);
+}
+
+/* --------------------------------- Full collection --------------------------------- */
+
+static void gray_ref(su_state *s, gc_t **ref, void *ud) {
+	add_to_gray(s, *ref);
+}
+
+static void mark_roots(su_state *s) {
 	int i;
 	gc_t *gcv;
-	s->gc_gray_size = 0;
 	for (i = 0; i < s->stack_top; i++) {
 		gcv = get_gc_object(&s->stack[i]);
 		if (gcv) add_to_gray(s, gcv);
 	}
 	if (s->globals.type != SU_NIL) {
 		add_to_gray(s, s->globals.obj.gc_object);
-		add_to_gray(s, s->strings.obj.gc_object);
+		for (i = 0; i < 256; i++) {
+			if (s->chars[i]) add_to_gray(s, &s->chars[i]->gc);
+		}
 	}
 	/* Add locals registry. */
 }
 
-static void scan(su_state *s) {
+/* The bytes an object takes up, which is what tracing it costs. */
+static size_t heap_size(gc_t *obj) {
+	if (obj->gen == GC_GEN_YOUNG)
+		return object_size(obj);
+	if (obj->flags & GC_FLAG_LARGE)
+		return large_of(obj)->size;
+	return page_of(obj)->size;
+}
+
+/*
+	Weak objects are marked but not traced, finish_mark looks at them once
+	everything else is marked. Young collections and compaction trace them
+	like any other object, so they hold on to young objects until the next
+	full cycle.
+*/
+#define weak_type(obj) ((obj)->type == SU_WEAK || (obj)->type == SU_EPHEMERON)
+
+/* Traces gray objects until the stack is empty or the work is used up, returns the work left. */
+static size_t mark(su_state *s, size_t work) {
 	gc_t *obj;
-	gc_t *child;
-	
-	while (s->gc_gray_size) {
+	size_t size;
+	while (s->gc_gray_size && work) {
 		obj = s->gc_gray[--s->gc_gray_size];
-		if (obj->flags == GC_FLAG_BLACK)
+		if (!weak_type(obj))
+			traverse(s, obj, gray_ref, NULL);
+		size = heap_size(obj);
+		work = work > size ? work - size : 0;
+	}
+	return work;
+}
+
+#ifdef SU_OPT_PARALLEL_GC
+
+/*
+	Every worker owns a deque, the owner pushes and pops at the tail and
+	thieves take one object at a time from the head. Only the last object
+	can be fought over, so the owner takes the lock when the ends meet.
+*/
+typedef struct mark_pool mark_pool_t;
+
+typedef struct {
+	gc_t **items;
+	volatile long head;
+	volatile long tail;
+	long cap;
+	mutex_t lock;
+	thread_t thread;
+	mark_pool_t *pool;
+} mark_worker_t;
+
+struct mark_pool {
+	su_state *s;
+	mark_worker_t workers[GC_MAX_WORKERS];
+	unsigned num;
+	volatile long idle;
+	mutex_t alloc_lock;
+};
+
+static int set_mark_atomic(su_state *s, gc_t *obj) {
+	unsigned bit, *word;
+	if (obj->flags & GC_FLAG_LARGE)
+		return !atomic_or(&large_of(obj)->marked, 1);
+	word = mark_word(s, obj, &bit);
+	return !(atomic_or(word, bit) & bit);
+}
+
+static void parallel_ref(su_state *s, gc_t **ref, void *ud);
+
+/*
+	A marked object that finds no room is left on the gray stack, which is
+	not used while the workers run, and traced by the calling thread once
+	they are done. If that is full too it is traced right away.
+*/
+static void overflow(mark_worker_t *w, gc_t *obj) {
+	su_state *s = w->pool->s;
+	mutex_lock(&w->pool->alloc_lock);
+	if (s->gc_gray_size < s->gc_gray_cap) {
+		s->gc_gray[s->gc_gray_size++] = obj;
+		obj = NULL;
+	}
+	mutex_unlock(&w->pool->alloc_lock);
+	if (obj && !weak_type(obj))
+		traverse(s, obj, parallel_ref, w);
+}
+
+/* The allocator is not assumed to be thread safe and can not raise errors here. */
+static void deque_push(mark_worker_t *w, gc_t *obj) {
+	gc_t **items;
+	long n;
+	mark_pool_t *pool = w->pool;
+	if (w->tail == w->cap) {
+		mutex_lock(&w->lock);
+		n = w->tail - w->head;
+		if (w->head >= w->cap / 2) {
+			memmove(w->items, w->items + w->head, sizeof(gc_t*) * n);
+		} else {
+			mutex_lock(&pool->alloc_lock);
+			items = (gc_t**)pool->s->alloc(pool->s->alloc_ud, w->items, sizeof(gc_t*) * w->cap, sizeof(gc_t*) * w->cap * 2, SU_ALLOC_STATE);
+			mutex_unlock(&pool->alloc_lock);
+			if (!items) {
+				mutex_unlock(&w->lock);
+				overflow(w, obj);
+				return;
+			}
+			memmove(items, items + w->head, sizeof(gc_t*) * n);
+			w->items = items;
+			w->cap *= 2;
+		}
+		w->head = 0;
+		w->tail = n;
+		mutex_unlock(&w->lock);
+	}
+	w->items[w->tail] = obj;
+	memory_fence();
+	w->tail++;
+}
+
+static gc_t *deque_pop(mark_worker_t *w) {
+	long t = w->tail - 1;
+	w->tail = t;
+	memory_fence();
+	if (w->head > t) {
+		w->tail = t + 1;
+		mutex_lock(&w->lock);
+		t = w->tail - 1;
+		w->tail = t;
+		if (w->head > t) {
+			w->head = w->tail = 0;
+			mutex_unlock(&w->lock);
+			return NULL;
+		}
+		mutex_unlock(&w->lock);
+	}
+	return w->items[t];
+}
+
+static gc_t *deque_steal(mark_worker_t *w) {
+	gc_t *obj = NULL;
+	mutex_lock(&w->lock);
+	w->head++;
+	memory_fence();
+	if (w->head > w->tail)
+		w->head--;
+	else
+		obj = w->items[w->head - 1];
+	mutex_unlock(&w->lock);
+	return obj;
+}
+
+static gc_t *steal_any(mark_worker_t *w) {
+	unsigned i;
+	gc_t *obj;
+	mark_worker_t *victim;
+	mark_pool_t *pool = w->pool;
+	unsigned self = (unsigned)(w - pool->workers);
+	for (i = 1; i < pool->num; i++) {
+		victim = &pool->workers[(self + i) % pool->num];
+		if (victim->tail > victim->head && (obj = deque_steal(victim)))
+			return obj;
+	}
+	return NULL;
+}
+
+static int work_left(mark_pool_t *pool) {
+	unsigned i;
+	for (i = 0; i < pool->num; i++) {
+		if (pool->workers[i].tail > pool->workers[i].head)
+			return 1;
+	}
+	return 0;
+}
+
+static void parallel_ref(su_state *s, gc_t **ref, void *ud) {
+	if (set_mark_atomic(s, *ref))
+		deque_push((mark_worker_t*)ud, *ref);
+}
+
+/* Work is only pushed by busy workers, so when all of them are idle the deques are empty for good. */
+static void run_worker(mark_worker_t *w) {
+	gc_t *obj;
+	mark_pool_t *pool = w->pool;
+	for (;;) {
+		while ((obj = deque_pop(w)) || (obj = steal_any(w))) {
+			if (!weak_type(obj))
+				traverse(pool->s, obj, parallel_ref, w);
+		}
+		atomic_add(&pool->idle, 1);
+		while (!work_left(pool)) {
+			if (pool->idle == (long)pool->num)
+				return;
+			thread_yield();
+		}
+		atomic_add(&pool->idle, -1);
+	}
+}
+
+THREAD_ENTRY(mark_thread, arg) {
+	run_worker((mark_worker_t*)arg);
+	THREAD_RETURN;
+}
+
+/* The calling thread is the first worker and starts out with the whole gray stack. */
+static void parallel_mark(su_state *s) {
+	unsigned i, started;
+	mark_worker_t *w;
+	mark_pool_t *pool = (mark_pool_t*)mem_allocate(s, NULL, 0, sizeof(mark_pool_t), SU_ALLOC_STATE);
+	
+	pool->s = s;
+	pool->num = s->gc_workers;
+	pool->idle = 0;
+	mutex_init(&pool->alloc_lock);
+	for (i = 0; i < pool->num; i++) {
+		w = &pool->workers[i];
+		w->cap = GC_GRAY_SIZE;
+		w->head = w->tail = 0;
+		w->pool = pool;
+		mutex_init(&w->lock);
+		w->items = (gc_t**)mem_allocate(s, NULL, 0, sizeof(gc_t*) * w->cap, SU_ALLOC_STATE);
+	}
+	
+	w = &pool->workers[0];
+	if (s->gc_gray_size > (unsigned)w->cap) {
+		w->items = (gc_t**)mem_allocate(s, w->items, sizeof(gc_t*) * w->cap, sizeof(gc_t*) * s->gc_gray_size, SU_ALLOC_STATE);
+		w->cap = s->gc_gray_size;
+	}
+	memcpy(w->items, s->gc_gray, sizeof(gc_t*) * s->gc_gray_size);
+	w->tail = s->gc_gray_size;
+	s->gc_gray_size = 0;
+	
+	/* Workers that could not be started never had work and count as idle. */
+	for (started = 1; started < pool->num; started++) {
+		if (!thread_start(&pool->workers[started].thread, mark_thread, &pool->workers[started]))
+			break;
+	}
+	atomic_add(&pool->idle, (long)(pool->num - started));
+	run_worker(w);
+	
+	for (i = 1; i < started; i++)
+		thread_join(pool->workers[i].thread);
+	for (i = 0; i < pool->num; i++) {
+		mutex_destroy(&pool->workers[i].lock);
+		mem_allocate(s, pool->workers[i].items, sizeof(gc_t*) * pool->workers[i].cap, 0, SU_ALLOC_STATE);
+	}
+	mutex_destroy(&pool->alloc_lock);
+	mem_allocate(s, pool, sizeof(mark_pool_t), 0, SU_ALLOC_STATE);
+}
+
+#endif
+
+/*
+	Traces everything that is gray, on all workers if the heap is big enough
+	to pay for them. What the workers had no room for is finished here.
+*/
+static void mark_all(su_state *s) {
+	#ifdef SU_OPT_PARALLEL_GC
+		if (s->gc_workers > 1 && s->gc_bytes >= GC_PARALLEL_HEAP)
+			parallel_mark(s);
+	#endif
+	while (s->gc_gray_size)
+		mark(s, (size_t)-1);
+}
+
+/* Values, or anything else that is not a heap object, can not die. */
+static int alive(su_state *s, value_t *v) {
+	gc_t *obj = get_gc_object(v);
+	return !obj || gc_marked(s, obj);
+}
+
+/*
+	The value of an entry is marked when its key is, which can mark the key
+	of another entry, so the live ephemerons are scanned until a pass marks
+	nothing new.
+*/
+static void mark_ephemerons(su_state *s) {
+	unsigned i;
+	int found;
+	gc_t *w, *val;
+	ephemeron_t *e;
+	do {
+		found = 0;
+		for (w = s->gc_weak; w; w = weak_next(w)) {
+			if (w->type != SU_EPHEMERON || !gc_marked(s, w))
+				continue;
+			e = (ephemeron_t*)w;
+			for (i = 0; i < e->cap; i++) {
+				if (ephemeron_free(e, i) || !alive(s, &e->slots[i * 2]))
+					continue;
+				val = get_gc_object(&e->slots[i * 2 + 1]);
+				if (val && set_mark(s, val)) {
+					push_gray(s, val);
+					found = 1;
+				}
+			}
+		}
+		mark_all(s);
+	} while (found);
+}
+
+/* Dead weak objects leave the list before the sweep frees them, live ones forget what died. */
+static void clear_weak(su_state *s) {
+	unsigned i;
+	gc_t *w, **l;
+	ephemeron_t *e;
+	for (l = &s->gc_weak; *l;) {
+		w = *l;
+		if (!gc_marked(s, w)) {
+			*l = weak_next(w);
 			continue;
-		
-		obj->flags = GC_FLAG_BLACK;
-		switch (obj->type) {
-			case SU_LOCAL:
-				child = get_gc_object(&((local_t*)obj)->v);
-				if (child) add_to_gray(s, child);
-				break;
-			case SU_VECTOR:
-				gray_vector(s, obj);
-				break;
-			case VECTOR_NODE:
-				gray_vector_node(s, obj);
-				break;
-			case SU_FUNCTION:
-				gray_function(s, obj);
-				break;
-			case SU_MAP:
-				add_to_gray(s, &((map_t*)obj)->root->gc);
-				break;
-			case MAP_COLLISION:
-				add_to_gray(s, &((node_collision_t*)obj)->leaves->gc);
-				break;
-			case MAP_FULL:
-				add_to_gray(s, &((node_full_t*)obj)->nodes->gc);
-				break;
-			case MAP_IDX:
-				add_to_gray(s, &((node_idx_t*)obj)->nodes->gc);
-				break;
-			case MAP_LEAF:
-				child = get_gc_object(&((node_leaf_t*)obj)->key);
-				if (child) add_to_gray(s, child);
-				child = get_gc_object(&((node_leaf_t*)obj)->val);
-				if (child) add_to_gray(s, child);
-				break;
-			case CELL_SEQ:
-				child = get_gc_object(&((cell_seq_t*)obj)->first);
-				if (child) add_to_gray(s, child);
-				child = get_gc_object(&((cell_seq_t*)obj)->rest);
-				if (child) add_to_gray(s, child);
-				break;
-			case IT_SEQ:
-				add_to_gray(s, ((it_seq_t*)obj)->obj);
-				break;
-		}
-	}
-}
-
-static void end(su_state *s) {
-	gc_t *tmp;
-	gc_t *prev = NULL;
-	gc_t *obj = s->gc_root;
-
-	while (obj) {
-		if (obj->flags == GC_FLAG_WHITE) {
-			if (prev)
-				prev->next = obj->next;
-			else
-				s->gc_root = obj->next;
-			tmp = obj;
-			obj = obj->next;
-			free_object(s, tmp);
-			s->num_objects--;
+		}
+		if (w->type == SU_WEAK) {
+			if (!alive(s, &((weak_t*)w)->v))
+				((weak_t*)w)->v.type = SU_NIL;
 		} else {
-			obj->flags = GC_FLAG_WHITE;
-			prev = obj;
-			obj = obj->next;
+			e = (ephemeron_t*)w;
+			for (i = 0; i < e->cap; i++) {
+				if (!ephemeron_free(e, i) && !alive(s, &e->slots[i * 2]))
+					ephemeron_remove_slot(e, i);
+			}
 		}
+		l = &weak_next(w);
 	}
 }
 
-void gc_trace(su_state *s) {
-	if (s->num_objects > ALIVE_OBJECTS) {
-		if (s->gc_gray_size == 0)
-			begin(s);
-		scan(s);
-		if (s->gc_gray_size == 0)
-			end(s);
+/*
+	The stack and the globals are not covered by the barrier, so they are
+	traced once more and the cycle is finished in one go. After that nothing
+	can reach an unmarked object, not even through the weak string table or
+	a weak object. Freeing is left to the sweep.
+*/
+static void finish_mark(su_state *s) {
+	unsigned i, j;
+	mark_roots(s);
+	mark_all(s);
+	mark_ephemerons(s);
+	clear_weak(s);
+	strings_sweep(s);
+	
+	/* Remembered objects that are about to be freed are forgotten. */
+	for (i = j = 0; i < s->gc_remembered_size; i++) {
+		if (gc_marked(s, s->gc_remembered[i]))
+			s->gc_remembered[j++] = s->gc_remembered[i];
+	}
+	s->gc_remembered_size = j;
+	
+	s->gc_epoch++;
+	for (i = 0; i < GC_SIZE_CLASSES; i++)
+		s->gc_sweep[i] = &s->pages[i];
+	s->gc_sweep_class = 0;
+	s->gc_sweep_large = &s->large;
+	s->gc_state = GC_STATE_SWEEP;
+}
+
+/* Only the bitmaps are read, objects are touched when they are freed. Returns the number freed. */
+static unsigned sweep_page(su_state *s, page_t *p) {
+	unsigned i, dead, freed = 0;
+	gc_t *obj;
+	for (i = 0; i < GC_PAGE_BITMAP_WORDS; i++) {
+		dead = p->alloc[i] & ~p->marks[i];
+		p->alloc[i] &= p->marks[i];
+		p->marks[i] = 0;
+		for (; dead; dead &= dead - 1) {
+			obj = page_object(p, i * 32 + lowest_bit(dead));
+			free_object(s, obj);
+			*(gc_t**)obj = p->free;
+			p->free = obj;
+			freed++;
+		}
+	}
+	p->used -= freed;
+	p->epoch = s->gc_epoch;
+	s->gc_bytes -= freed * p->size;
+	if (freed && p->used && !p->avail)
+		avail_insert(s, p);
+	return freed;
+}
+
+/*
+	Sweeps the page under the cursor of a size class and moves the cursor
+	past it, returns the cost. Pages created during the sweep count as
+	swept, empty pages are given back.
+*/
+static size_t sweep_next(su_state *s, unsigned cls) {
+	page_t *p = *s->gc_sweep[cls];
+	size_t cost = sizeof(page_t*);
+	if (p->epoch != s->gc_epoch) {
+		cost += sizeof(p->alloc) + sizeof(p->marks) + sweep_page(s, p) * p->size;
+		if (!p->used) {
+			*s->gc_sweep[cls] = p->next;
+			page_release(s, p);
+			return cost;
+		}
+	}
+	s->gc_sweep[cls] = &p->next;
+	return cost;
+}
+
+/* An allocation that finds no free slot sweeps its own size class until one turns up, before the heap grows. */
+static page_t *sweep_class(su_state *s, unsigned cls) {
+	while (*s->gc_sweep[cls] && !s->pages_avail[cls])
+		sweep_next(s, cls);
+	return s->pages_avail[cls];
+}
+
+static size_t sweep_large(su_state *s, size_t work) {
+	large_t *l;
+	size_t cost;
+	while (*s->gc_sweep_large && work) {
+		l = *s->gc_sweep_large;
+		cost = sizeof(large_t);
+		if (l->marked) {
+			l->marked = 0;
+			s->gc_sweep_large = &l->next;
+		} else {
+			*s->gc_sweep_large = l->next;
+			free_object(s, (gc_t*)(l + 1));
+			s->gc_bytes -= l->size;
+			cost += l->size;
+			mem_allocate(s, l, sizeof(large_t) + l->size, 0, SU_ALLOC_LARGE);
+		}
+		work = work > cost ? work - cost : 0;
+	}
+	return work;
+}
+
+/* Size classes are swept in order and the large objects last. */
+static size_t sweep(su_state *s, size_t work) {
+	size_t cost;
+	while (s->gc_sweep_class < GC_SIZE_CLASSES && work) {
+		if (!*s->gc_sweep[s->gc_sweep_class]) {
+			s->gc_sweep_class++;
+			continue;
+		}
+		cost = sweep_next(s, s->gc_sweep_class);
+		work = work > cost ? work - cost : 0;
+	}
+	work = sweep_large(s, work);
+	
+	if (s->gc_sweep_class == GC_SIZE_CLASSES && !*s->gc_sweep_large) {
+		s->gc_state = GC_STATE_PAUSE;
+		/* Let the heap grow by the pause factor over what survived before the next cycle. */
+		s->gc_threshold = s->gc_bytes / 100 * s->gc_pause;
+		if (s->gc_threshold < s->gc_min_heap)
+			s->gc_threshold = s->gc_min_heap;
+	}
+	return work;
+}
+
+static void step(su_state *s, size_t work) {
+	if (s->gc_state == GC_STATE_PAUSE) {
+		/* Young objects may still be marked from the last cycle. */
+		memset(s->nursery_marks, 0, NURSERY_MARKS_SIZE);
+		s->gc_gray_size = 0;
+		mark_roots(s);
+		s->gc_state = GC_STATE_MARK;
 	}
+	if (s->gc_state == GC_STATE_MARK) {
+		if (work == (size_t)-1)
+			mark_all(s);
+		else
+			work = mark(s, work);
+		if (s->gc_gray_size)
+			return;
+		finish_mark(s);
+	}
+	sweep(s, work);
+}
+
+/*
+	A full nursery is collected first. The heap is then stepped with a fixed
+	amount of work plus the step multiplier times the bytes allocated since
+	the last step, so the collector stays ahead.
+*/
+void gc_trace(su_state *s) {
+	size_t work = GC_STEP_SIZE;
+	if (s->nursery_end - s->nursery_top < NURSERY_OBJECT_MAX && !in_native(s))
+		minor(s);
+	if (s->gc_state == GC_STATE_PAUSE && s->gc_bytes <= s->gc_threshold)
+		return;
+	if (s->gc_bytes > s->gc_stepped)
+		work += (s->gc_bytes - s->gc_stepped) / 100 * s->gc_step_mul;
+	step(s, work);
+	s->gc_stepped = s->gc_bytes;
 }
 
 void su_gc(su_state *s) {
-	while (s->gc_gray_size > 0)
-		gc_trace(s);
-	begin(s);
-	while (s->gc_gray_size > 0)
-		scan(s);
-	end(s);
+	if (!in_native(s))
+		minor(s);
+	/* Finish the cycle in progress, a new one is needed to see what died since it started. */
+	while (s->gc_state != GC_STATE_PAUSE)
+		step(s, (size_t)-1);
+	do {
+		step(s, (size_t)-1);
+	} while (s->gc_state != GC_STATE_PAUSE);
+	s->gc_stepped = s->gc_bytes;
+}
+
+/* --------------------------------- Compaction --------------------------------- */
+
+/* The types that can be young, nothing outside the heap points to them while no native is running. */
+static int movable(gc_t *obj) {
+	switch (obj->type) {
+		case SU_VECTOR:
+		case VECTOR_NODE:
+		case SU_MAP:
+		case MAP_NODE:
+		case MAP_COLLISION:
+		case MAP_ARRAY:
+		case CELL_SEQ:
+		case LAZY_SEQ:
+		case CHUNK_SEQ:
+		case SU_TRANSIENT:
+		case REDUCED:
+		case XFORM:
+		case ROPE:
+		case EDIT:
+			return 1;
+	}
+	return 0;
+}
+
+static int page_movable(page_t *p) {
+	unsigned i, bits;
+	for (i = 0; i < GC_PAGE_BITMAP_WORDS; i++) {
+		for (bits = p->alloc[i]; bits; bits &= bits - 1) {
+			if (!movable(page_object(p, i * 32 + lowest_bit(bits))))
+				return 0;
+		}
+	}
+	return 1;
+}
+
+/* Segments with little live data and no pinned object are emptied completely, so they can be freed. */
+static void select_segments(su_state *s) {
+	unsigned cls;
+	page_t *p;
+	segment_t *seg;
+	
+	for (seg = s->segments; seg; seg = seg->next) {
+		seg->live = 0;
+		seg->evacuating = 1;
+	}
+	for (cls = 0; cls < GC_SIZE_CLASSES; cls++) {
+		for (p = s->pages[cls]; p; p = p->next) {
+			p->seg->live += p->used * p->size;
+			if (!page_movable(p))
+				p->seg->evacuating = 0;
+		}
+	}
+	for (seg = s->segments; seg; seg = seg->next) {
+		if (seg->live * 100 >= (size_t)GC_SEGMENT_PAGES * GC_PAGE_SIZE * GC_COMPACT_OCCUPANCY)
+			seg->evacuating = 0;
+	}
+}
+
+/*
+	Unlinks the pages of a size class that are used below GC_COMPACT_OCCUPANCY,
+	or lie in an evacuated segment, and hold no pinned object. A single page is left alone unless its objects
+	fit in the other pages, or it would just be copied to a new one.
+*/
+static page_t *evacuation_candidates(su_state *s, unsigned cls) {
+	page_t *p, **l;
+	page_t *evac = NULL;
+	unsigned num = 0, live = 0, room = 0;
+	
+	for (l = &s->pages[cls]; *l;) {
+		p = *l;
+		if (p->seg->evacuating || (p->used * 100 < page_slots(p) * GC_COMPACT_OCCUPANCY && page_movable(p))) {
+			*l = p->next;
+			p->next = evac;
+			evac = p;
+			live += p->used;
+			num++;
+		} else {
+			room += page_slots(p) - p->used;
+			l = &p->next;
+		}
+	}
+	
+	if (num == 1 && live > room) {
+		evac->next = s->pages[cls];
+		s->pages[cls] = evac;
+		return NULL;
+	}
+	for (p = evac; p; p = p->next) {
+		if (p->avail)
+			avail_remove(s, p);
+	}
+	return evac;
+}
+
+/* The pages being emptied are out of the lists, so the copies land elsewhere. */
+static void evacuate(su_state *s, page_t *p) {
+	unsigned i, bits;
+	gc_t *obj, *copy;
+	for (i = 0; i < GC_PAGE_BITMAP_WORDS; i++) {
+		for (bits = p->alloc[i]; bits; bits &= bits - 1) {
+			obj = page_object(p, i * 32 + lowest_bit(bits));
+			copy = heap_allocate(s, p->size);
+			memcpy(copy, obj, p->size);
+			obj->gen = GC_GEN_FORWARDED;
+			forward(obj) = copy;
+		}
+	}
+}
+
+/* Nothing is young after a full collection, so promote_ref only follows forwarding pointers. */
+static void forward_refs(su_state *s) {
+	unsigned i, bits, cls;
+	page_t *p;
+	large_t *l;
+	
+	for (i = 0; i < (unsigned)s->stack_top; i++)
+		visit_value(s, &s->stack[i], promote_ref, NULL);
+	visit_value(s, &s->globals, promote_ref, NULL);
+	for (i = 0; i < s->gc_remembered_size; i++) {
+		if (s->gc_remembered[i]->gen == GC_GEN_FORWARDED)
+			s->gc_remembered[i] = forward(s->gc_remembered[i]);
+	}
+	
+	for (cls = 0; cls < GC_SIZE_CLASSES; cls++) {
+		for (p = s->pages[cls]; p; p = p->next) {
+			for (i = 0; i < GC_PAGE_BITMAP_WORDS; i++) {
+				for (bits = p->alloc[i]; bits; bits &= bits - 1)
+					traverse(s, page_object(p, i * 32 + lowest_bit(bits)), promote_ref, NULL);
+			}
+		}
+	}
+	for (l = s->large; l; l = l->next)
+		traverse(s, (gc_t*)(l + 1), promote_ref, NULL);
+}
+
+/*
+	Collects everything and then empties sparse pages by moving their objects
+	to fuller ones, so pages and segments can be given back. Objects that
+	natives or frames can point to are pinned by type, the rest can only
+	move when no native is running.
+*/
+void su_gc_compact(su_state *s) {
+	unsigned cls;
+	page_t *p;
+	segment_t *seg;
+	page_t *evac[GC_SIZE_CLASSES];
+	
+	su_gc(s);
+	if (in_native(s))
+		return;
+	
+	select_segments(s);
+	for (cls = 0; cls < GC_SIZE_CLASSES; cls++) {
+		evac[cls] = evacuation_candidates(s, cls);
+		for (p = evac[cls]; p; p = p->next)
+			evacuate(s, p);
+	}
+	forward_refs(s);
+	
+	for (cls = 0; cls < GC_SIZE_CLASSES; cls++) {
+		while (evac[cls]) {
+			p = evac[cls];
+			evac[cls] = p->next;
+			s->gc_bytes -= p->used * p->size;
+			p->used = 0;
+			page_release(s, p);
+		}
+	}
+	for (seg = s->segments; seg; seg = seg->next)
+		seg->evacuating = 0;
+	s->gc_stepped = s->gc_bytes;
+}
+
+/* Zero keeps the current value. The new threshold is used from the next cycle. */
+void su_gc_config(su_state *s, unsigned pause, unsigned step_mul, size_t min_heap) {
+	if (pause) s->gc_pause = pause;
+	if (step_mul) s->gc_step_mul = step_mul;
+	if (min_heap) s->gc_min_heap = min_heap;
+}
+
+/*
+	Memory natives own outside the heap is counted as heap, so allocating a
+	big buffer brings the next collection closer and pays for its steps.
+*/
+void su_external_memory(su_state *s, long delta) {
+	assert(delta >= 0 || (size_t)-delta <= s->gc_bytes);
+	s->gc_bytes += (size_t)delta;
+	if (delta > 0)
+		s->interupt |= IGC;
+}
+
+void gc_init(su_state *s) {
+	unsigned i, c;
+	assert(sizeof(unsigned) == 4);
+	assert(sizeof(value_t) <= sizeof(su_value));
+	
+	s->gc_bytes = 0;
+	s->gc_pause = GC_PAUSE;
+	s->gc_step_mul = GC_STEP_MUL;
+	s->gc_min_heap = GC_MIN_HEAP;
+	s->gc_threshold = GC_MIN_HEAP;
+	s->gc_stepped = 0;
+	#ifdef SU_OPT_PARALLEL_GC
+		s->gc_workers = cpu_count() < GC_MAX_WORKERS ? cpu_count() : GC_MAX_WORKERS;
+	#else
+		s->gc_workers = 1;
+	#endif
+	s->gc_state = GC_STATE_PAUSE;
+	s->gc_epoch = 0;
+	memset(s->gc_sweep, 0, sizeof(s->gc_sweep));
+	s->gc_sweep_class = GC_SIZE_CLASSES;
+	s->gc_sweep_large = NULL;
+	
+	s->gc_gray_cap = GC_GRAY_SIZE;
+	s->gc_gray_size = 0;
+	s->gc_gray = (gc_t**)mem_allocate(s, NULL, 0, sizeof(gc_t*) * GC_GRAY_SIZE, SU_ALLOC_STATE);
+	s->gc_remembered_cap = GC_REMEMBERED_SIZE;
+	s->gc_remembered_size = 0;
+	s->gc_remembered = (gc_t**)mem_allocate(s, NULL, 0, sizeof(gc_t*) * GC_REMEMBERED_SIZE, SU_ALLOC_STATE);
+	
+	s->nursery = (char*)mem_allocate(s, NULL, 0, NURSERY_SIZE, SU_ALLOC_HEAP);
+	s->nursery_top = s->nursery;
+	s->nursery_end = s->nursery + NURSERY_SIZE;
+	s->nursery_marks = (unsigned*)mem_allocate(s, NULL, 0, NURSERY_MARKS_SIZE, SU_ALLOC_STATE);
+	memset(s->nursery_marks, 0, NURSERY_MARKS_SIZE);
+	
+	memset(s->pages, 0, sizeof(s->pages));
+	s->segments = NULL;
+	s->large = NULL;
+	s->gc_weak = NULL;
+	memset(s->pages_avail, 0, sizeof(s->pages_avail));
+	for (i = c = 0; i <= GC_SIZE_CLASS_MAX / GC_PAGE_GRANULE; i++) {
+		while (size_classes[c] < i * GC_PAGE_GRANULE)
+			c++;
+		s->size_class[i] = (unsigned char)c;
+	}
+}
+
+/* Whatever is left after the last collection is freed without being looked at. */
+void gc_close(su_state *s) {
+	large_t *l;
+	segment_t *seg;
+	while (s->large) {
+		l = s->large;
+		s->large = l->next;
+		mem_allocate(s, l, sizeof(large_t) + l->size, 0, SU_ALLOC_LARGE);
+	}
+	while (s->segments) {
+		seg = s->segments;
+		s->segments = seg->next;
+		mem_allocate(s, seg->mem, SEGMENT_SIZE, 0, SU_ALLOC_HEAP);
+		mem_allocate(s, seg, sizeof(segment_t), 0, SU_ALLOC_HEAP);
+	}
+	mem_allocate(s, s->gc_gray, sizeof(gc_t*) * s->gc_gray_cap, 0, SU_ALLOC_STATE);
+	mem_allocate(s, s->gc_remembered, sizeof(gc_t*) * s->gc_remembered_cap, 0, SU_ALLOC_STATE);
+	mem_allocate(s, s->nursery, NURSERY_SIZE, 0, SU_ALLOC_HEAP);
+	mem_allocate(s, s->nursery_marks, NURSERY_MARKS_SIZE, 0, SU_ALLOC_STATE);
 }
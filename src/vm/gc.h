@@ -28,15 +28,78 @@
 #include "saurus.h"
 #include "intern.h"
 
-#define ALIVE_OBJECTS 100000
+enum {
+	GC_FLAG_LARGE = 0x1
+};
+
+/*
+	Defaults for su_gc_config. A cycle starts when the heap has grown to
+	GC_PAUSE percent of what was live after the last one, and each step
+	does GC_STEP_MUL percent of the bytes allocated since the step before.
+*/
+#define GC_PAUSE 200
+#define GC_STEP_MUL 200
+#define GC_MIN_HEAP (1024 * 1024)
+
+/* Bytes traced or swept per step, on top of what the step multiplier asks for. */
+#define GC_STEP_SIZE (16 * 1024)
+
+/* With SU_OPT_PARALLEL_GC, marks that are done in one go use a thread per core on heaps this big. */
+#define GC_PARALLEL_HEAP (64 * 1024 * 1024)
+#define GC_MAX_WORKERS 16
+
+enum {
+	GC_STATE_PAUSE,
+	GC_STATE_MARK,
+	GC_STATE_SWEEP
+};
 
 enum {
-	GC_FLAG_TRANS,
-	GC_FLAG_WHITE,
-	GC_FLAG_GRAY,
-	GC_FLAG_BLACK
+	GC_GEN_YOUNG,
+	GC_GEN_OLD,
+	GC_GEN_REMEMBERED,
+	GC_GEN_FORWARDED
 };
 
+/* Young objects are bump allocated from the nursery, bigger ones go straight to the heap. */
+#define NURSERY_SIZE (512 * 1024)
+#define NURSERY_OBJECT_MAX 2048
+#define NURSERY_ALIGN 8
+
+/*
+	Old objects up to GC_SIZE_CLASS_MAX bytes live in pages of one size
+	class, pages are aligned so an object finds its page and mark bit from
+	its address. Pages are carved from segments, a segment is given back
+	when all its pages are empty.
+*/
+#define GC_PAGE_SIZE 16384
+#define GC_PAGE_GRANULE 8
+#define GC_PAGE_BITMAP_WORDS (GC_PAGE_SIZE / GC_PAGE_GRANULE / 32)
+#define GC_SEGMENT_PAGES 32
+
+/* su_gc_compact empties pages that are used below this percentage. */
+#define GC_COMPACT_OCCUPANCY 50
+
+/*
+	Every store of a value_t into an already-allocated object must be preceded
+	by gc_barrier on that object. This covers shared vector tails, nodes owned
+	by a transient, ephemeron slots and realized lazy sequences. Objects filled
+	in by the native that allocated them are exempt, since collection only runs
+	between instructions. String builders only hold chars and need no barrier.
+*/
+#define gc_barrier(s, obj) \
+	do { \
+		if ((obj)->gen == GC_GEN_OLD) gc_remember((s), (obj)); \
+		if ((s)->gc_state == GC_STATE_MARK) gc_regray((s), (obj)); \
+	} while (0)
+
+gc_t *gc_allocate(su_state *s, size_t size, su_object_type_t type);
+gc_t *gc_allocate_old(su_state *s, size_t size, su_object_type_t type);
+void gc_init(su_state *s);
+void gc_close(su_state *s);
+int gc_marked(su_state *s, gc_t *obj);
 void gc_trace(su_state *s);
+void gc_regray(su_state *s, gc_t *obj);
+void gc_remember(su_state *s, gc_t *obj);
 
 #endif
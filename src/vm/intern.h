@@ -35,6 +35,9 @@
 #define STACK_SIZE 512
 #define SCRATCH_PAD_SIZE 512
 #define GC_GRAY_SIZE 512
+#define GC_REMEMBERED_SIZE 512
+#define GC_SIZE_CLASSES 27
+#define GC_SIZE_CLASS_MAX 2048
 
 #define STK(n) (&s->stack[s->stack_top + (n)])
 #define FRAME() (&s->frames[s->frame_top - 1])
@@ -63,24 +66,29 @@ typedef struct reader_buffer reader_buffer_t;
 
 typedef struct map map_t;
 typedef struct node node_t;
-typedef struct node_leaf node_leaf_t;
-typedef struct node_full node_full_t;
-typedef struct node_idx node_idx_t;
-typedef struct node_collision node_collision_t;
+
+typedef struct page page_t;
+typedef struct segment segment_t;
+typedef struct large large_t;
 
 typedef void (*thread_entry_t)(su_state*);
 
 enum {
 	PROTOTYPE = SU_NUM_OBJECT_TYPES,
 	VECTOR_NODE,
-	MAP_LEAF,
-	MAP_EMPTY,
-	MAP_FULL,
-	MAP_IDX,
+	MAP_NODE,
 	MAP_COLLISION,
+	MAP_ARRAY,
 	GLOBAL_INTERNAL,
 	CELL_SEQ,
-	IT_SEQ
+	CHUNK_SEQ,
+	STRING_SEQ,
+	LAZY_SEQ,
+	REDUCED,
+	XFORM,
+	STRING_BUILDER,
+	ROPE,
+	EDIT
 };
 
 enum {
@@ -95,10 +103,12 @@ enum {
 	IGC = 0x1
 };
 
+/* Mark bits are kept by the page the object lives in, not in the object. */
 struct gc {
-	gc_t *next;
 	unsigned char type;
 	unsigned char flags;
+	unsigned char gen;
+	unsigned id;
 };
 
 typedef struct {
@@ -106,13 +116,33 @@ typedef struct {
 	char str[1];
 } const_string_t;
 
+/* Strings longer than this are not interned and hash themselves on first use. */
+#define STRING_INTERN_MAX 64
+
+enum {
+	STRING_INTERNED = 0x1,
+	STRING_HASHED = 0x2,
+	STRING_SLICE = 0x4,
+	STRING_DETACHED = 0x8
+};
+
+/*
+	A slice points into the characters of its parent and has no terminator of
+	its own, it gets a private copy the first time C code asks for one.
+*/
 typedef struct {
 	gc_t gc;
 	unsigned hash;
 	unsigned size;
-	char str[1];
+	unsigned char flags;
+	char *str;
+	gc_t *parent;
+	char data[1];
 } string_t;
 
+/* The size never counts a terminator, a string that is not a slice always has one after its characters. */
+#define string_len(v) ((v)->size)
+
 typedef struct {
 	unsigned char id;
 	union {
@@ -123,7 +153,7 @@ typedef struct {
 
 typedef struct {
 	gc_t gc;
-	su_data_class_t *vt;
+	const su_data_class_t *vt;
 	unsigned char data[1];
 } native_data_t;
 
@@ -143,6 +173,10 @@ struct value {
 		local_t *loc;
 		native_data_t *data;
 		void *ptr;
+		struct {
+			gc_t *obj;
+			int idx;
+		} it;
 		unsigned char value_data[SU_VALUE_DATA_SIZE];
 	} obj;
 	unsigned char type;
@@ -183,15 +217,45 @@ struct function {
 
 struct state {
 	su_alloc alloc;
+	void *alloc_ud;
+	
+	page_t *pages[GC_SIZE_CLASSES];
+	page_t *pages_avail[GC_SIZE_CLASSES];
+	segment_t *segments;
+	large_t *large;
+	unsigned char size_class[GC_SIZE_CLASS_MAX / 8 + 1];
 	
-	gc_t *gc_root;
 	gc_t *gc_locals;
-	gc_t *gc_gray[GC_GRAY_SIZE];
+	gc_t *gc_weak;
+	gc_t **gc_gray;
 	unsigned gc_gray_size;
-	unsigned num_objects;
+	unsigned gc_gray_cap;
+	page_t **gc_sweep[GC_SIZE_CLASSES];
+	unsigned gc_sweep_class;
+	large_t **gc_sweep_large;
+	unsigned gc_epoch;
+	int gc_state;
+	size_t gc_bytes;
+	size_t gc_threshold;
+	size_t gc_stepped;
+	unsigned gc_pause;
+	unsigned gc_step_mul;
+	size_t gc_min_heap;
+	unsigned gc_workers;
+	gc_t **gc_remembered;
+	unsigned gc_remembered_size;
+	unsigned gc_remembered_cap;
+	char *nursery;
+	char *nursery_top;
+	char *nursery_end;
+	unsigned *nursery_marks;
 
 	value_t globals;
-	value_t strings;
+	string_t **strings;
+	unsigned strings_cap;
+	unsigned strings_cnt;
+	unsigned strings_used;
+	string_t *chars[256];
 	
 	char scratch_pad[SCRATCH_PAD_SIZE];
 	FILE *fstdin, *fstdout, *fstderr;
@@ -210,17 +274,39 @@ struct state {
 	
 	int frame_top;
 	frame_t frames[MAX_CALLS];
+	int pinned;
 	
 	int stack_top;
 	value_t stack[STACK_SIZE];
 };
 
+void mem_error(su_state *s);
+
+/* All memory of the VM goes through here, only a failure leaves the inline path. */
+static INLINE UNUSED void *mem_allocate(su_state *s, void *p, size_t osize, size_t nsize, su_alloc_type_t type) {
+	void *np = s->alloc(s->alloc_ud, p, osize, nsize, type);
+	if (nsize) {
+		s->interupt |= IGC;
+		if (!np)
+			mem_error(s);
+	}
+	return np;
+}
+
 unsigned hash_value(value_t *v);
 void push_value(su_state *s, value_t *v);
 int value_eq(value_t *a, value_t *b);
 int read_prototype(su_state *s, reader_buffer_t *buffer, prototype_t *prot);
-gc_t *gc_insert_object(su_state *s, gc_t *obj, su_object_type_t type);
-gc_t *string_from_db(su_state *s, unsigned hash, unsigned size, const char *str);
+void free_prototype(su_state *s, prototype_t *prot);
+gc_t *string_from_db(su_state *s, unsigned len, const char *str);
+void strings_sweep(su_state *s);
+gc_t *string_create(su_state *s, unsigned len, const char *str);
+gc_t *string_slice(su_state *s, string_t *str, unsigned start, unsigned len);
+gc_t *string_char(su_state *s, char c);
+const char *string_cstr(su_state *s, string_t *str);
+unsigned string_hash(string_t *str);
 unsigned murmur(const void *key, int len, unsigned seed);
+void number_format(char *buffer, double n);
+double number_parse(const char *str);
 
 #endif
@@ -58,17 +58,20 @@ static void print_rec(su_state *s, int idx) {
 	FILE *fp = stdout;
 	int type = su_type(s, idx);
 
-	if (su_type(s, -1) == SU_SEQ) {
+	/* Stepping inside a chunk does not allocate, and each level only keeps its cursor and one value on the stack. */
+	if (type == SU_SEQ) {
 		fprintf(fp, "(");
+		su_copy(s, idx);
 		for (i = 0; su_type(s, -1) != SU_NIL; i++) {
 			if (i > 0) fprintf(fp, " ");
 			su_first(s, -1);
 			print_rec(s, -1);
 			su_pop(s, 1);
 			su_rest(s, -1);
+			su_replace(s, -2);
 		}
 		fprintf(fp, ")");
-		su_pop(s, i);
+		su_pop(s, 1);
 	} else {
 		switch (type) {
 			case SU_VECTOR:
@@ -128,7 +131,240 @@ static int string(su_state *s, int narg) {
 
 static int number(su_state *s, int narg) {
 	su_check_arguments(s, 1, SU_STRING);
-	su_pushnumber(s, atof(su_tostring(s, -1, NULL)));
+	su_pushnumber(s, su_tonumber(s, -1));
+	return 1;
+}
+
+static int substring(su_state *s, int narg) {
+	su_check_arguments(s, 3, SU_STRING, SU_NUMBER, SU_NUMBER);
+	su_substring(s, -3, su_tointeger(s, -2), su_tointeger(s, -1));
+	return 1;
+}
+
+/* The kernels below test 16 bytes at a time and finish the tail byte by byte. */
+
+static unsigned first_bit(unsigned mask) {
+	#ifdef __GNUC__
+		return (unsigned)__builtin_ctz(mask);
+	#else
+		unsigned i;
+		for (i = 0; !(mask & 1); i++)
+			mask >>= 1;
+		return i;
+	#endif
+}
+
+/* Returns the index of the first c in p, or n. */
+static unsigned scan_byte(const char *p, unsigned n, char c) {
+	unsigned i = 0;
+	#if defined(SU_SIMD_SSE2)
+		int mask;
+		__m128i needle = _mm_set1_epi8(c);
+		for (; i + 16 <= n; i += 16) {
+			mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i)), needle));
+			if (mask)
+				return i + first_bit((unsigned)mask);
+		}
+	#elif defined(SU_SIMD_NEON)
+		uint8x16_t needle = vdupq_n_u8((unsigned char)c);
+		for (; i + 16 <= n; i += 16) {
+			if (vmaxvq_u8(vceqq_u8(vld1q_u8((const unsigned char*)p + i), needle)))
+				break;
+		}
+	#endif
+	for (; i < n; i++) {
+		if (p[i] == c)
+			return i;
+	}
+	return n;
+}
+
+/* Returns the index of the first byte in p that is one of set, or n. */
+static unsigned scan_set(const char *p, unsigned n, const char *set, unsigned num) {
+	unsigned i = 0, j;
+	unsigned char table[256];
+	#if defined(SU_SIMD_SSE2)
+		int mask;
+		__m128i block;
+		__m128i any;
+		if (num <= 16) {
+			for (; i + 16 <= n; i += 16) {
+				block = _mm_loadu_si128((const __m128i*)(p + i));
+				any = _mm_setzero_si128();
+				for (j = 0; j < num; j++)
+					any = _mm_or_si128(any, _mm_cmpeq_epi8(block, _mm_set1_epi8(set[j])));
+				mask = _mm_movemask_epi8(any);
+				if (mask)
+					return i + first_bit((unsigned)mask);
+			}
+		}
+	#elif defined(SU_SIMD_NEON)
+		uint8x16_t block, any;
+		if (num <= 16) {
+			for (; i + 16 <= n; i += 16) {
+				block = vld1q_u8((const unsigned char*)p + i);
+				any = vdupq_n_u8(0);
+				for (j = 0; j < num; j++)
+					any = vorrq_u8(any, vceqq_u8(block, vdupq_n_u8((unsigned char)set[j])));
+				if (vmaxvq_u8(any))
+					break;
+			}
+		}
+	#endif
+	memset(table, 0, sizeof(table));
+	for (j = 0; j < num; j++)
+		table[(unsigned char)set[j]] = 1;
+	for (; i < n; i++) {
+		if (table[(unsigned char)p[i]])
+			return i;
+	}
+	return n;
+}
+
+static unsigned count_byte(const char *p, unsigned n, char c) {
+	unsigned i = 0, count = 0;
+	#if defined(SU_SIMD_SSE2)
+		unsigned mask;
+		__m128i needle = _mm_set1_epi8(c);
+		for (; i + 16 <= n; i += 16) {
+			mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i)), needle));
+			for (; mask; count++)
+				mask &= mask - 1;
+		}
+	#elif defined(SU_SIMD_NEON)
+		uint8x16_t needle = vdupq_n_u8((unsigned char)c);
+		for (; i + 16 <= n; i += 16)
+			count += vaddvq_u8(vandq_u8(vceqq_u8(vld1q_u8((const unsigned char*)p + i), needle), vdupq_n_u8(1)));
+	#endif
+	for (; i < n; i++)
+		count += p[i] == c;
+	return count;
+}
+
+/* Finds needle by scanning for its first byte, returns n if it is not there. */
+static unsigned search(const char *p, unsigned n, const char *needle, unsigned m) {
+	unsigned i = 0;
+	if (m == 0)
+		return 0;
+	while (m <= n - i) {
+		i += scan_byte(p + i, n - i - m + 1, needle[0]);
+		if (m > n - i)
+			break;
+		if (!memcmp(p + i + 1, needle + 1, m - 1))
+			return i;
+		i++;
+	}
+	return n;
+}
+
+static int string_index_of(su_state *s, int narg) {
+	unsigned n, m, start, i;
+	const char *str, *needle;
+	su_check_arguments(s, -2, SU_STRING, SU_STRING);
+	start = narg > 2 ? (unsigned)su_tointeger(s, 2 - narg) : 0;
+	str = su_tochars(s, -narg, &n);
+	needle = su_tochars(s, 1 - narg, &m);
+	if (start > n)
+		return 0;
+	i = search(str + start, n - start, needle, m);
+	if (i == n - start && m > 0)
+		return 0;
+	su_pushinteger(s, (int)(start + i));
+	return 1;
+}
+
+static int string_index_any(su_state *s, int narg) {
+	unsigned n, m, start, i;
+	const char *str, *set;
+	su_check_arguments(s, -2, SU_STRING, SU_STRING);
+	start = narg > 2 ? (unsigned)su_tointeger(s, 2 - narg) : 0;
+	str = su_tochars(s, -narg, &n);
+	set = su_tochars(s, 1 - narg, &m);
+	if (start >= n)
+		return 0;
+	i = scan_set(str + start, n - start, set, m);
+	if (i == n - start)
+		return 0;
+	su_pushinteger(s, (int)(start + i));
+	return 1;
+}
+
+static int string_count(su_state *s, int narg) {
+	unsigned n, m, i, count = 0;
+	const char *str, *needle;
+	su_check_arguments(s, 2, SU_STRING, SU_STRING);
+	str = su_tochars(s, -2, &n);
+	needle = su_tochars(s, -1, &m);
+	su_assert(s, m > 0, "Can't count empty strings!");
+	if (m == 1) {
+		count = count_byte(str, n, needle[0]);
+	} else {
+		for (i = 0; (i += search(str + i, n - i, needle, m)) < n; i += m)
+			count++;
+	}
+	su_pushinteger(s, (int)count);
+	return 1;
+}
+
+/* The pieces are slices of the string, pushed onto a transient in batches. */
+static int string_split(su_state *s, int narg) {
+	unsigned n, m, i, j;
+	int pending = 0;
+	const char *str, *sep;
+	su_check_arguments(s, 2, SU_STRING, SU_STRING);
+	str = su_tochars(s, -2, &n);
+	sep = su_tochars(s, -1, &m);
+	su_assert(s, m > 0, "Can't split on empty string!");
+	
+	su_vector(s, 0);
+	su_vector_transient(s, -1);
+	for (i = 0; ; i = j + m) {
+		j = i + search(str + i, n - i, sep, m);
+		su_substring(s, -4 - pending, (int)i, (int)j);
+		if (++pending == 32) {
+			su_transient_push(s, -33, 32);
+			pending = 0;
+		}
+		if (j == n)
+			break;
+	}
+	su_transient_push(s, -1 - pending, pending);
+	su_persistent(s, -1);
+	return 1;
+}
+
+static int string_builder(su_state *s, int narg) {
+	su_check_arguments(s, 0);
+	su_string_builder(s);
+	return 1;
+}
+
+static int append(su_state *s, int narg) {
+	su_check_arguments(s, -1, SU_NIL);
+	su_string_append(s, -narg, narg - 1);
+	return 1;
+}
+
+static int to_string(su_state *s, int narg) {
+	su_check_arguments(s, 1, SU_NIL);
+	su_flatten(s, -1);
+	return 1;
+}
+
+static int rope(su_state *s, int narg) {
+	su_rope(s, narg);
+	return 1;
+}
+
+static int rope_length(su_state *s, int narg) {
+	su_check_arguments(s, 1, SU_NIL);
+	su_pushinteger(s, su_rope_length(s, -1));
+	return 1;
+}
+
+static int rope_slice(su_state *s, int narg) {
+	su_check_arguments(s, 3, SU_NIL, SU_NUMBER, SU_NUMBER);
+	su_rope_slice(s, -3, su_tointeger(s, -2), su_tointeger(s, -1));
 	return 1;
 }
 
@@ -151,6 +387,47 @@ static int set(su_state *s, int narg) {
 	return 1;
 }
 
+static int weak_ref(su_state *s, int narg) {
+	su_check_arguments(s, 1, SU_NIL);
+	su_ref_weak(s, -1);
+	return 1;
+}
+
+static int weak_unref(su_state *s, int narg) {
+	su_check_arguments(s, 1, SU_WEAK);
+	su_unref_weak(s, -1);
+	return 1;
+}
+
+static int ephemeron(su_state *s, int narg) {
+	su_check_arguments(s, 0);
+	su_ephemeron(s);
+	return 1;
+}
+
+static int ephemeron_length(su_state *s, int narg) {
+	su_check_arguments(s, 1, SU_EPHEMERON);
+	su_pushinteger(s, su_ephemeron_length(s, -1));
+	return 1;
+}
+
+static int ephemeron_get(su_state *s, int narg) {
+	su_check_arguments(s, 2, SU_EPHEMERON, SU_NIL);
+	return su_ephemeron_get(s, -2);
+}
+
+static int ephemeron_set(su_state *s, int narg) {
+	su_check_arguments(s, 3, SU_EPHEMERON, SU_NIL, SU_NIL);
+	su_ephemeron_set(s, -3);
+	return 1;
+}
+
+static int ephemeron_remove(su_state *s, int narg) {
+	su_check_arguments(s, 2, SU_EPHEMERON, SU_NIL);
+	su_ephemeron_remove(s, -2);
+	return 1;
+}
+
 static int input(su_state *s, int narg) {
     #ifdef SU_OPT_NO_FILE_IO
         return 0;
@@ -215,32 +492,35 @@ static int read(su_state *s, int narg) {
         return 0;
     #else
         int size;
-        void *mem;
+        char *mem;
         size_t res;
         char buffer[4096];
         su_check_arguments(s, 1, SU_NUMBER);
         size = su_tointeger(s, -1);
+        /* The input is read straight into the string, a short read keeps a slice of it. */
         if (size > 0) {
-            mem = su_allocate(s, NULL, size);
+            mem = su_newbytes(s, size);
             res = fread(mem, 1, size, su_stdin(s));
-            if (!res) {
-                su_allocate(s, mem, 0);
+            if (!res)
                 return 0;
-            }
-            su_pushbytes(s, mem, size);
-            su_allocate(s, mem, 0);
+            if ((int)res < size)
+                su_substring(s, -1, 0, (int)res);
         } else if (size < 0) {
             if (su_stdin(s) == stdin) {
-                su_pushstring(s, gets(buffer));
+                /* Returns nil at end of input, so it can be used as a line source for pipelines. */
+                if (!fgets(buffer, sizeof(buffer), stdin))
+                    return 0;
+                size = (int)strlen(buffer);
+                if (size > 0 && buffer[size - 1] == '\n')
+                    buffer[size - 1] = '\0';
+                su_pushstring(s, buffer);
                 return 1;
             }
             fseek(su_stdin(s), 0, SEEK_END);
             size = (int)ftell(su_stdin(s));
             fseek(su_stdin(s), 0, SEEK_CUR);
-            mem = su_allocate(s, NULL, size);
+            mem = su_newbytes(s, size);
             su_assert(s, size == (int)fread(mem, 1, size, su_stdin(s)), "IO error: %d (%s)", errno, strerror(errno));
-            su_pushbytes(s, mem, size);
-            su_allocate(s, mem, 0);
         } else {
             su_pushstring(s, "");
         }
@@ -259,6 +539,29 @@ void su_libinit(su_state *s) {
 	su_setglobal(s, 1, "string!");
 	su_pushfunction(s, &number);
 	su_setglobal(s, 1, "number!");
+	su_pushfunction(s, &substring);
+	su_setglobal(s, 1, "substring");
+
+	su_pushfunction(s, &string_index_of);
+	su_setglobal(s, 1, "string-index-of");
+	su_pushfunction(s, &string_index_any);
+	su_setglobal(s, 1, "string-index-any");
+	su_pushfunction(s, &string_count);
+	su_setglobal(s, 1, "string-count");
+	su_pushfunction(s, &string_split);
+	su_setglobal(s, 1, "string-split");
+	su_pushfunction(s, &string_builder);
+	su_setglobal(s, 1, "string-builder");
+	su_pushfunction(s, &append);
+	su_setglobal(s, 1, "append!");
+	su_pushfunction(s, &to_string);
+	su_setglobal(s, 1, "to-string");
+	su_pushfunction(s, &rope);
+	su_setglobal(s, 1, "rope");
+	su_pushfunction(s, &rope_length);
+	su_setglobal(s, 1, "rope-length");
+	su_pushfunction(s, &rope_slice);
+	su_setglobal(s, 1, "rope-slice");
 
 	su_pushfunction(s, &unref);
 	su_setglobal(s, 1, "unref");
@@ -266,6 +569,20 @@ void su_libinit(su_state *s) {
 	su_setglobal(s, 1, "ref");
 	su_pushfunction(s, &set);
 	su_setglobal(s, 1, "set");
+	su_pushfunction(s, &weak_ref);
+	su_setglobal(s, 1, "weak-ref");
+	su_pushfunction(s, &weak_unref);
+	su_setglobal(s, 1, "weak-unref");
+	su_pushfunction(s, &ephemeron);
+	su_setglobal(s, 1, "ephemeron");
+	su_pushfunction(s, &ephemeron_length);
+	su_setglobal(s, 1, "ephemeron-length");
+	su_pushfunction(s, &ephemeron_get);
+	su_setglobal(s, 1, "ephemeron-get");
+	su_pushfunction(s, &ephemeron_set);
+	su_setglobal(s, 1, "ephemeron-set!");
+	su_pushfunction(s, &ephemeron_remove);
+	su_setglobal(s, 1, "ephemeron-remove!");
 
 	su_pushfunction(s, &input);
 	su_setglobal(s, 1, "input");
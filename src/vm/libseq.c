@@ -41,10 +41,18 @@ static int list(su_state *s, int narg) {
 
 static int cons(su_state *s, int narg) {
 	su_check_arguments(s, 2, SU_NIL, SU_NIL);
+	su_copy(s, -2);
 	su_cons(s, -2);
 	return 1;
 }
 
+static int lazy_seq(su_state *s, int narg) {
+	su_check_arguments(s, 1, SU_NIL);
+	su_assert(s, su_type(s, -1) == SU_FUNCTION || su_type(s, -1) == SU_NATIVEFUNC, "Expected function!");
+	su_lazy_seq(s);
+	return 1;
+}
+
 static int first(su_state *s, int narg) {
 	su_check_arguments(s, 1, SU_SEQ);
 	su_first(s, -1);
@@ -57,6 +65,66 @@ static int rest(su_state *s, int narg) {
 	return 1;
 }
 
+static int reduce(su_state *s, int narg) {
+	su_check_arguments(s, 3, SU_NIL, SU_NIL, SU_NIL);
+	su_copy(s, -3);
+	su_copy(s, -3);
+	su_reduce(s, -3);
+	return 1;
+}
+
+static int reduce_kv(su_state *s, int narg) {
+	su_check_arguments(s, 3, SU_NIL, SU_NIL, SU_NIL);
+	su_copy(s, -3);
+	su_copy(s, -3);
+	su_reduce_kv(s, -3);
+	return 1;
+}
+
+static int reduced(su_state *s, int narg) {
+	su_check_arguments(s, 1, SU_NIL);
+	su_reduced(s);
+	return 1;
+}
+
+static int xform_map(su_state *s, int narg) {
+	su_check_arguments(s, 1, SU_NIL);
+	su_xform(s, SU_XF_MAP);
+	return 1;
+}
+
+static int xform_filter(su_state *s, int narg) {
+	su_check_arguments(s, 1, SU_NIL);
+	su_xform(s, SU_XF_FILTER);
+	return 1;
+}
+
+static int xform_take(su_state *s, int narg) {
+	su_check_arguments(s, 1, SU_NUMBER);
+	su_xform(s, SU_XF_TAKE);
+	return 1;
+}
+
+static int xform_drop(su_state *s, int narg) {
+	su_check_arguments(s, 1, SU_NUMBER);
+	su_xform(s, SU_XF_DROP);
+	return 1;
+}
+
+static int transduce(su_state *s, int narg) {
+	su_check_arguments(s, -3, SU_NIL, SU_NIL, SU_NIL);
+	su_copy_range(s, -narg, narg - 1);
+	su_transduce(s, -narg, narg - 3);
+	return 1;
+}
+
+static int into(su_state *s, int narg) {
+	su_check_arguments(s, -2, SU_NIL, SU_NIL);
+	su_copy_range(s, -narg, narg - 1);
+	su_into(s, -narg, narg - 2);
+	return 1;
+}
+
 static int vector(su_state *s, int narg) {
 	su_vector(s, narg);
 	return 1;
@@ -64,7 +132,7 @@ static int vector(su_state *s, int narg) {
 
 static int vector_length(su_state *s, int narg) {
 	su_check_arguments(s, 1, SU_VECTOR);
-	su_vector_length(s, -1);
+	su_pushinteger(s, su_vector_length(s, -1));
 	return 1;
 }
 
@@ -126,14 +194,65 @@ static int map_insert(su_state *s, int narg) {
 
 static int map_remove(su_state *s, int narg) {
 	su_check_arguments(s, 2, SU_MAP, SU_NIL);
-	su_assert(s, su_map_has(s, -3), "Key does not exist in map!");
-	su_map_remove(s, -1);
+	su_assert(s, su_map_has(s, -2), "Key does not exist in map!");
+	su_map_remove(s, -2);
 	return 1;
 }
 
 static int map_has(su_state *s, int narg) {
 	su_check_arguments(s, 2, SU_MAP, SU_NIL);
-	su_pushboolean(s, su_map_has(s, -1));
+	su_pushboolean(s, su_map_has(s, -2));
+	return 1;
+}
+
+static int transient(su_state *s, int narg) {
+	su_check_arguments(s, 1, SU_NIL);
+	switch (su_type(s, -1)) {
+		case SU_VECTOR:
+			su_vector_transient(s, -1);
+			break;
+		case SU_MAP:
+			su_map_transient(s, -1);
+			break;
+		default:
+			su_error(s, "Expected vector or map!");
+	}
+	return 1;
+}
+
+static int persistent(su_state *s, int narg) {
+	su_check_arguments(s, 1, SU_TRANSIENT);
+	su_persistent(s, -1);
+	return 1;
+}
+
+static int vector_push_transient(su_state *s, int narg) {
+	su_check_arguments(s, -1, SU_TRANSIENT);
+	su_transient_push(s, -narg, narg - 1);
+	return 1;
+}
+
+static int vector_set_transient(su_state *s, int narg) {
+	su_check_arguments(s, 3, SU_TRANSIENT, SU_NUMBER, SU_NIL);
+	su_transient_set(s, -3);
+	return 1;
+}
+
+static int vector_pop_transient(su_state *s, int narg) {
+	su_check_arguments(s, 1, SU_TRANSIENT);
+	su_transient_pop(s, -1);
+	return 1;
+}
+
+static int map_set_transient(su_state *s, int narg) {
+	su_check_arguments(s, 3, SU_TRANSIENT, SU_NIL, SU_NIL);
+	su_transient_set(s, -3);
+	return 1;
+}
+
+static int map_remove_transient(su_state *s, int narg) {
+	su_check_arguments(s, 2, SU_TRANSIENT, SU_NIL);
+	su_transient_remove(s, -2);
 	return 1;
 }
 
@@ -144,10 +263,30 @@ void libseq(su_state *s) {
 	su_setglobal(s, 1, "list");
 	su_pushfunction(s, &cons);
 	su_setglobal(s, 1, "cons");
+	su_pushfunction(s, &lazy_seq);
+	su_setglobal(s, 1, "lazy-seq");
 	su_pushfunction(s, &first);
 	su_setglobal(s, 1, "first");
 	su_pushfunction(s, &rest);
 	su_setglobal(s, 1, "rest");
+	su_pushfunction(s, &reduce);
+	su_setglobal(s, 1, "reduce");
+	su_pushfunction(s, &reduce_kv);
+	su_setglobal(s, 1, "reduce-kv");
+	su_pushfunction(s, &reduced);
+	su_setglobal(s, 1, "reduced");
+	su_pushfunction(s, &xform_map);
+	su_setglobal(s, 1, "xform-map");
+	su_pushfunction(s, &xform_filter);
+	su_setglobal(s, 1, "xform-filter");
+	su_pushfunction(s, &xform_take);
+	su_setglobal(s, 1, "xform-take");
+	su_pushfunction(s, &xform_drop);
+	su_setglobal(s, 1, "xform-drop");
+	su_pushfunction(s, &transduce);
+	su_setglobal(s, 1, "transduce");
+	su_pushfunction(s, &into);
+	su_setglobal(s, 1, "into");
 	
 	su_pushfunction(s, &vector);
 	su_setglobal(s, 1, "vector");
@@ -176,4 +315,19 @@ void libseq(su_state *s) {
 	su_setglobal(s, 1, "map-remove");
 	su_pushfunction(s, &map_has);
 	su_setglobal(s, 1, "map-has");
+	
+	su_pushfunction(s, &transient);
+	su_setglobal(s, 1, "transient");
+	su_pushfunction(s, &persistent);
+	su_setglobal(s, 1, "persistent!");
+	su_pushfunction(s, &vector_push_transient);
+	su_setglobal(s, 1, "vector-push!");
+	su_pushfunction(s, &vector_set_transient);
+	su_setglobal(s, 1, "vector-set!");
+	su_pushfunction(s, &vector_pop_transient);
+	su_setglobal(s, 1, "vector-pop!");
+	su_pushfunction(s, &map_set_transient);
+	su_setglobal(s, 1, "map-set!");
+	su_pushfunction(s, &map_remove_transient);
+	su_setglobal(s, 1, "map-remove!");
 }
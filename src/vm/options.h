@@ -29,5 +29,6 @@
 
 /* #define SU_OPT_DYNLIB */
 /* #define SU_OPT_NO_FILE_IO */
+/* #define SU_OPT_PARALLEL_GC */
 
 #endif
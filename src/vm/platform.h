@@ -45,6 +45,22 @@
 	#define INLINE
 #endif
 
+/* For static functions in headers that not every includer calls. */
+#ifdef __GNUC__
+	#define UNUSED __attribute__((unused))
+#else
+	#define UNUSED
+#endif
+
+/* C89 has no 64 bit integer, number formatting falls back on sprintf without one. */
+#if defined(_MSC_VER)
+	#define SU_HAS_U64
+	typedef unsigned __int64 u64_t;
+#elif defined(__GNUC__)
+	#define SU_HAS_U64
+	__extension__ typedef unsigned long long u64_t;
+#endif
+
 #if !defined(SU_OPT_DYNLIB)
 	static INLINE void lib_unload(void *lib) {}
 
@@ -114,4 +130,13 @@ static INLINE const char *platform_name() {
 	return NULL;
 }
 
+/* Vector units that are always present on the platforms above. */
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__)
+	#define SU_SIMD_SSE2
+	#include <emmintrin.h>
+#elif defined(__aarch64__)
+	#define SU_SIMD_NEON
+	#include <arm_neon.h>
+#endif
+
 #endif
@@ -25,13 +25,15 @@
 #include "saurus.h"
 #include "intern.h"
 #include "ref.h"
+#include "gc.h"
+
+#include <string.h>
 
 value_t ref_local(su_state *s, value_t *val) {
 	value_t v;
 	v.type = SU_LOCAL;
-	v.obj.loc = (local_t*)su_allocate(s, NULL, sizeof(local_t));
+	v.obj.loc = (local_t*)gc_allocate_old(s, sizeof(local_t), SU_LOCAL);
 	v.obj.loc->v = *val;
-	gc_insert_object(s, &v.obj.loc->gc, SU_LOCAL);
 	return v;
 }
 
@@ -46,6 +48,151 @@ void su_unref_local(su_state *s, int idx) {
 
 void su_set_local(su_state *s, int idx) {
 	local_t *loc = STK(idx)->obj.loc;
+	gc_barrier(s, &loc->gc);
 	loc->v = *STK(-1);
 	su_pop(s, 1);
 }
+
+/* Weak objects are never young, so the list holds addresses that do not change. */
+static void link_weak(su_state *s, gc_t *obj) {
+	weak_next(obj) = s->gc_weak;
+	s->gc_weak = obj;
+}
+
+value_t ref_weak(su_state *s, value_t *val) {
+	value_t v;
+	v.type = SU_WEAK;
+	v.obj.gc_object = gc_allocate_old(s, sizeof(weak_t), SU_WEAK);
+	((weak_t*)v.obj.gc_object)->v = *val;
+	link_weak(s, v.obj.gc_object);
+	return v;
+}
+
+#define EPHEMERON_MIN 8
+
+static void ephemeron_alloc(su_state *s, ephemeron_t *e, unsigned cap) {
+	e->slots = (value_t*)mem_allocate(s, NULL, 0, sizeof(value_t) * 2 * cap, SU_ALLOC_STATE);
+	memset(e->slots, 0, sizeof(value_t) * 2 * cap);
+	e->cap = cap;
+	e->used = e->cnt;
+}
+
+value_t ephemeron_create(su_state *s) {
+	value_t v;
+	ephemeron_t *e = (ephemeron_t*)gc_allocate_old(s, sizeof(ephemeron_t), SU_EPHEMERON);
+	e->cnt = 0;
+	e->slots = NULL;
+	ephemeron_alloc(s, e, EPHEMERON_MIN);
+	link_weak(s, &e->gc);
+	v.type = SU_EPHEMERON;
+	v.obj.gc_object = &e->gc;
+	return v;
+}
+
+/* Returns the slot of the key or the empty slot that ends its probe chain. */
+static unsigned ephemeron_find(ephemeron_t *e, value_t *key) {
+	unsigned mask = e->cap - 1;
+	unsigned i = hash_value(key) & mask;
+	while (!ephemeron_free(e, i) || e->slots[i * 2 + 1].type != SU_INV) {
+		if (!ephemeron_free(e, i) && value_eq(&e->slots[i * 2], key))
+			return i;
+		i = (i + 1) & mask;
+	}
+	return i;
+}
+
+/* Rehashing also drops the removed slots. */
+static void ephemeron_resize(su_state *s, ephemeron_t *e, unsigned cap) {
+	unsigned i, j;
+	value_t *old = e->slots;
+	unsigned old_cap = e->cap;
+	
+	ephemeron_alloc(s, e, cap);
+	for (i = 0; i < old_cap; i++) {
+		if (old[i * 2].type != SU_INV) {
+			j = ephemeron_find(e, &old[i * 2]);
+			e->slots[j * 2] = old[i * 2];
+			e->slots[j * 2 + 1] = old[i * 2 + 1];
+		}
+	}
+	mem_allocate(s, old, sizeof(value_t) * 2 * old_cap, 0, SU_ALLOC_STATE);
+}
+
+value_t ephemeron_get(ephemeron_t *e, value_t *key) {
+	value_t v;
+	unsigned i = ephemeron_find(e, key);
+	if (ephemeron_free(e, i)) {
+		v.type = SU_INV;
+		return v;
+	}
+	return e->slots[i * 2 + 1];
+}
+
+void ephemeron_set(su_state *s, ephemeron_t *e, value_t *key, value_t *val) {
+	unsigned i, cap;
+	gc_barrier(s, &e->gc);
+	i = ephemeron_find(e, key);
+	if (!ephemeron_free(e, i)) {
+		e->slots[i * 2 + 1] = *val;
+		return;
+	}
+	
+	if ((e->used + 1) * 4 > e->cap * 3) {
+		for (cap = e->cap; (e->cnt + 1) * 2 > cap; cap *= 2);
+		ephemeron_resize(s, e, cap);
+		i = ephemeron_find(e, key);
+	}
+	e->slots[i * 2] = *key;
+	e->slots[i * 2 + 1] = *val;
+	e->cnt++;
+	e->used++;
+}
+
+void ephemeron_remove(ephemeron_t *e, value_t *key) {
+	unsigned i = ephemeron_find(e, key);
+	if (!ephemeron_free(e, i))
+		ephemeron_remove_slot(e, i);
+}
+
+void ephemeron_remove_slot(ephemeron_t *e, unsigned i) {
+	e->slots[i * 2].type = SU_INV;
+	e->slots[i * 2 + 1].type = SU_NIL;
+	e->cnt--;
+}
+
+void su_ref_weak(su_state *s, int idx) {
+	value_t v = ref_weak(s, STK(idx));
+	push_value(s, &v);
+}
+
+/* Pushes nil if the object has been collected. */
+void su_unref_weak(su_state *s, int idx) {
+	push_value(s, &((weak_t*)STK(idx)->obj.gc_object)->v);
+}
+
+void su_ephemeron(su_state *s) {
+	value_t v = ephemeron_create(s);
+	push_value(s, &v);
+}
+
+int su_ephemeron_length(su_state *s, int idx) {
+	return (int)((ephemeron_t*)STK(idx)->obj.gc_object)->cnt;
+}
+
+int su_ephemeron_get(su_state *s, int idx) {
+	value_t v = ephemeron_get((ephemeron_t*)STK(idx)->obj.gc_object, STK(-1));
+	if (v.type == SU_INV)
+		return 0;
+	push_value(s, &v);
+	return 1;
+}
+
+void su_ephemeron_set(su_state *s, int idx) {
+	ephemeron_set(s, (ephemeron_t*)STK(idx)->obj.gc_object, STK(-2), STK(-1));
+	su_pop(s, 2);
+}
+
+void su_ephemeron_remove(su_state *s, int idx) {
+	ephemeron_remove((ephemeron_t*)STK(idx)->obj.gc_object, STK(-1));
+	su_pop(s, 1);
+}
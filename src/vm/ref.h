@@ -33,6 +33,37 @@ struct local {
 	value_t v;
 };
 
+/*
+	Weak references and ephemerons are linked in a list the collector walks
+	after marking, to clear what died. Both start with the link.
+*/
+typedef struct {
+	gc_t gc;
+	gc_t *next;
+	value_t v;
+} weak_t;
+
+/* An open addressing table of key and value pairs, a value is only kept alive by its key. */
+typedef struct {
+	gc_t gc;
+	gc_t *next;
+	unsigned cnt;
+	unsigned used;
+	unsigned cap;
+	value_t *slots;
+} ephemeron_t;
+
+#define weak_next(obj) (((weak_t*)(obj))->next)
+
+/* An empty slot has an invalid key and value, a removed one an invalid key and a nil value. */
+#define ephemeron_free(e, i) ((e)->slots[(i) * 2].type == SU_INV)
+
 value_t ref_local(su_state *s, value_t *val);
+value_t ref_weak(su_state *s, value_t *val);
+value_t ephemeron_create(su_state *s);
+value_t ephemeron_get(ephemeron_t *e, value_t *key);
+void ephemeron_set(su_state *s, ephemeron_t *e, value_t *key, value_t *val);
+void ephemeron_remove(ephemeron_t *e, value_t *key);
+void ephemeron_remove_slot(ephemeron_t *e, unsigned i);
 
 #endif
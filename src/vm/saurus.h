@@ -41,25 +41,55 @@ enum {
 enum su_object_type {
     SU_INV, SU_NIL, SU_BOOLEAN, SU_STRING, SU_NUMBER,
     SU_SEQ, SU_FUNCTION, SU_NATIVEFUNC, SU_VECTOR, SU_MAP,
-    SU_LOCAL, SU_NATIVEPTR, SU_NATIVEDATA, SU_NUM_OBJECT_TYPES
+    SU_LOCAL, SU_NATIVEPTR, SU_NATIVEDATA, SU_TRANSIENT, SU_WEAK, SU_EPHEMERON,
+    SU_NUM_OBJECT_TYPES
 };
 
 typedef enum su_object_type su_object_type_t;
 
+enum su_xform_type {
+    SU_XF_MAP, SU_XF_FILTER, SU_XF_TAKE, SU_XF_DROP
+};
+
+typedef enum su_xform_type su_xform_type_t;
+
+enum su_alloc_type {
+    SU_ALLOC_STATE, SU_ALLOC_HEAP, SU_ALLOC_LARGE, SU_ALLOC_STRING,
+    SU_ALLOC_CODE, SU_ALLOC_NATIVE
+};
+
+typedef enum su_alloc_type su_alloc_type_t;
+
 typedef int (*su_nativefunc)(su_state*,int);
 typedef const void* (*su_reader)(size_t*,void*);
-typedef void* (*su_alloc)(void*,size_t);
+/* Frees when the new size is 0, the old size is 0 when the pointer is NULL. NULL is only returned when out of memory. */
+typedef void* (*su_alloc)(void*,void*,size_t,size_t,su_alloc_type_t);
 
+/* Room for a value kept by native data, a zeroed value reads as nil. */
+typedef struct {
+    double _[3];
+} su_value;
+
+typedef void (*su_visitor)(su_state*,su_value*,void*);
+
+/*
+    All callbacks are optional. Finalize runs when the data is collected and
+    must not call into the VM. Trace calls the visitor with every su_value the
+    data holds, it may run on a marking thread. Size is the memory the data
+    owns outside the heap, as reported with su_external_memory, the collector
+    takes it off again when the data is freed.
+*/
 typedef struct {
-    /* Fix this */
-    int _;
+    void (*finalize)(su_state*,void*);
+    void (*trace)(su_state*,void*,su_visitor,void*);
+    size_t (*size)(su_state*,void*);
 } su_data_class_t;
 
-su_state *su_init(su_alloc alloc);
+su_state *su_init(su_alloc alloc, void *ud);
 void su_close(su_state *s);
 void su_libinit(su_state *s);
 const char *su_version(int *major, int *minor, int *patch);
-void *su_allocate(su_state *s, void *p, size_t n);
+void *su_allocate(su_state *s, void *p, size_t osize, size_t nsize);
 
 void su_seterror(su_state *s, jmp_buf jmp, int flag);
 void su_error(su_state *s, const char *fmt, ...);
@@ -75,28 +105,62 @@ void su_pushnil(su_state *s);
 void su_pushfunction(su_state *s, su_nativefunc f);
 su_nativefunc su_tofunction(su_state *s, int idx);
 void su_pushnumber(su_state *s, double n);
+/* A string is parsed as a decimal number, any other type that is not a number gives 0. */
 double su_tonumber(su_state *s, int idx);
 void su_pushboolean(su_state *s, int b);
 int su_toboolean(su_state *s, int idx);
 void su_pushinteger(su_state *s, int i);
 int su_tointeger(su_state *s, int idx);
+/* The bytes are kept as they are, a terminator in them is part of the string. */
 void su_pushbytes(su_state *s, const char *ptr, unsigned size);
 void su_pushstring(su_state *s, const char *str);
+/* Pushes a string of size bytes and returns them to be filled in, it is not interned. */
+char *su_newbytes(su_state *s, unsigned size);
+/* The returned string is always terminated, the size counts the terminator. */
 const char *su_tostring(su_state *s, int idx, unsigned *size);
+/* The characters as they are stored, a slice is not copied and there may be no terminator. */
+const char *su_tochars(su_state *s, int idx, unsigned *len);
+void su_substring(su_state *s, int idx, int start, int end);
 void su_pushpointer(su_state *s, void *ptr);
 void *su_topointer(su_state *s, int idx);
 void *su_newdata(su_state *s, unsigned size, const su_data_class_t *vt);
-void *su_todata(su_state *s, const su_data_class_t *vt);
+void *su_todata(su_state *s, int idx, const su_data_class_t *vt);
+void su_data_set(su_state *s, int idx, su_value *slot);
+void su_data_get(su_state *s, su_value *slot);
 
 void su_ref_local(su_state *s, int idx);
 void su_unref_local(su_state *s, int idx);
 void su_set_local(su_state *s, int idx);
+void su_ref_weak(su_state *s, int idx);
+void su_unref_weak(su_state *s, int idx);
+
+void su_ephemeron(su_state *s);
+int su_ephemeron_length(su_state *s, int idx);
+int su_ephemeron_get(su_state *s, int idx);
+void su_ephemeron_set(su_state *s, int idx);
+void su_ephemeron_remove(su_state *s, int idx);
 
 void su_seq(su_state *s, int idx);
 void su_list(su_state *s, int num);
 void su_first(su_state *s, int idx);
 void su_rest(su_state *s, int idx);
+int su_chunk_first(su_state *s, int idx);
+void su_chunk_rest(su_state *s, int idx);
 void su_cons(su_state *s, int idx);
+void su_lazy_seq(su_state *s);
+void su_reduce(su_state *s, int idx);
+void su_reduce_kv(su_state *s, int idx);
+void su_reduced(su_state *s);
+void su_xform(su_state *s, su_xform_type_t kind);
+void su_transduce(su_state *s, int idx, int num);
+void su_into(su_state *s, int idx, int num);
+
+void su_string_builder(su_state *s);
+void su_string_append(su_state *s, int idx, int num);
+void su_flatten(su_state *s, int idx);
+void su_rope(su_state *s, int num);
+int su_rope_length(su_state *s, int idx);
+void su_rope_slice(su_state *s, int idx, int start, int end);
 
 void su_vector(su_state *s, int num);
 int su_vector_length(su_state *s, int idx);
@@ -112,6 +176,14 @@ void su_map_insert(su_state *s, int idx);
 void su_map_remove(su_state *s, int idx);
 int su_map_has(su_state *s, int idx);
 
+void su_vector_transient(su_state *s, int idx);
+void su_map_transient(su_state *s, int idx);
+void su_persistent(su_state *s, int idx);
+void su_transient_push(su_state *s, int idx, int num);
+void su_transient_set(su_state *s, int idx);
+void su_transient_pop(su_state *s, int idx);
+void su_transient_remove(su_state *s, int idx);
+
 int su_getglobal(su_state *s, const char *name);
 void su_setglobal(su_state *s, int replace, const char *name);
 
@@ -119,10 +191,14 @@ int su_load(su_state *s, su_reader reader, void *data);
 void su_call(su_state *s, int narg, int nret);
 void su_pop(su_state *s, int n);
 void su_copy(su_state *s, int idx);
+void su_replace(su_state *s, int idx);
 void su_copy_range(su_state *s, int idx, int num);
 void su_top(su_state *s);
 
 void su_gc(su_state *s);
+void su_gc_compact(su_state *s);
+void su_gc_config(su_state *s, unsigned pause, unsigned step_mul, size_t min_heap);
+void su_external_memory(su_state *s, long delta);
 
 FILE *su_stdout(su_state *s);
 FILE *su_stdin(su_state *s);
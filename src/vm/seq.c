@@ -26,6 +26,7 @@
 
 #include "seq.h"
 #include "intern.h"
+#include "gc.h"
 
 #include <string.h>
 #include <assert.h>
@@ -43,16 +44,16 @@ const seq_class_t cell_vt = {&cell_first, &cell_rest};
 value_t cell_create_array(su_state *s, value_t *array, int num) {
 	int i;
 	value_t tmp;
-	cell_seq_t *cell = (cell_seq_t*)su_allocate(s, NULL, sizeof(cell_seq_t) * num);
+	cell_seq_t *cell;
 	tmp.type = SU_NIL;
 	
 	for (i = num - 1; i >= 0; i--) {
+		cell = (cell_seq_t*)gc_allocate(s, sizeof(cell_seq_t), CELL_SEQ);
 		cell->first = array[i];
 		cell->rest = tmp;
 		cell->q.vt = &cell_vt;
 		tmp.type = CELL_SEQ;
-		tmp.obj.gc_object = gc_insert_object(s, &cell->q.gc, CELL_SEQ);
-		cell++;
+		tmp.obj.gc_object = &cell->q.gc;
 	}
 	
 	return tmp;
@@ -60,131 +61,129 @@ value_t cell_create_array(su_state *s, value_t *array, int num) {
 
 value_t cell_create(su_state *s, value_t *first, value_t *rest) {
 	value_t v;
-	cell_seq_t *cell = (cell_seq_t*)su_allocate(s, NULL, sizeof(cell_seq_t));
+	cell_seq_t *cell = (cell_seq_t*)gc_allocate(s, sizeof(cell_seq_t), CELL_SEQ);
 	cell->first = *first;
 	cell->rest = *rest;
 	cell->q.vt = &cell_vt;
 	
 	v.type = CELL_SEQ;
-	v.obj.gc_object = gc_insert_object(s, &cell->q.gc, CELL_SEQ);
+	v.obj.gc_object = &cell->q.gc;
 	return v;
 }
 
-static value_t it_next(su_state *s, it_seq_t *iq) {
+/*
+	A lazy seq calls its thunk the first time it is looked at and keeps the
+	result, the thunk is cleared so it can be collected. The thunk may return
+	nil, any seq or a vector or string.
+*/
+value_t lazy_force(su_state *s, lazy_seq_t *lz) {
 	value_t v;
-	it_seq_t *it = (it_seq_t*)su_allocate(s, NULL, sizeof(it_seq_t));
-	it->idx = iq->idx + 1;
-	it->obj = iq->obj;
-	it->q.vt = iq->q.vt;
+	if (lz->thunk.type == SU_NIL)
+		return lz->seq;
 	
-	v.type = IT_SEQ;
-	v.obj.gc_object = gc_insert_object(s, &it->q.gc, IT_SEQ);
-	return v;
-}
-
-static value_t it_string_first(su_state *s, seq_t *q) {
-	value_t v;
-	char buffer[2] = {0, 0};
-	it_seq_t *iq = (it_seq_t*)q;
-	buffer[0] = ((string_t*)iq->obj)->str[iq->idx];
+	/* Keep the seq reachable while the thunk runs. */
+	v.type = LAZY_SEQ;
+	v.obj.gc_object = &lz->q.gc;
+	push_value(s, &v);
+	push_value(s, &lz->thunk);
+	s->pinned++;
+	su_call(s, 0, 1);
+	s->pinned--;
 	
-	v.type = SU_STRING;
-	v.obj.gc_object = string_from_db(s, murmur(buffer, 2, 0), 2, buffer);
-	return v;
-}
-
-static value_t it_string_rest(su_state *s, seq_t *q) {
-	value_t v;
-	it_seq_t *iq = (it_seq_t*)q;
-	
-	if (iq->idx + 2 == ((string_t*)iq->obj)->size) {
-		v.type = SU_NIL;
-		return v;
+	v = *STK(-1);
+	switch (v.type) {
+		case SU_NIL:
+		case CELL_SEQ:
+		case CHUNK_SEQ:
+		case STRING_SEQ:
+			break;
+		case LAZY_SEQ:
+			v = lazy_force(s, (lazy_seq_t*)v.obj.q);
+			break;
+		case SU_VECTOR:
+			v = it_create_vector(s, v.obj.vec);
+			break;
+		case SU_STRING:
+			v = it_create_string(s, v.obj.str);
+			break;
+		default:
+			su_error(s, "Expected lazy sequence to produce a sequence!");
 	}
 	
-	return it_next(s, iq);
+	if (lz->thunk.type != SU_NIL) {
+		gc_barrier(s, &lz->q.gc);
+		lz->seq = v;
+		lz->thunk.type = SU_NIL;
+	}
+	su_pop(s, 2);
+	return lz->seq;
 }
 
-static value_t it_vector_first(su_state *s, seq_t *q) {
-	it_seq_t *iq = (it_seq_t*)q;
-	return vector_index(s, (vector_t*)iq->obj, iq->idx);
+static value_t lazy_first(su_state *s, seq_t *q) {
+	value_t v = lazy_force(s, (lazy_seq_t*)q);
+	return v.type == SU_NIL ? v : seq_first(s, &v);
 }
 
-static value_t it_vector_rest(su_state *s, seq_t *q) {
-	value_t v;
-	it_seq_t *iq = (it_seq_t*)q;
-	
-	if (iq->idx + 1 == ((vector_t*)iq->obj)->cnt) {
-		v.type = SU_NIL;
-		return v;
-	}
-	
-	return it_next(s, iq);
+static value_t lazy_rest(su_state *s, seq_t *q) {
+	value_t v = lazy_force(s, (lazy_seq_t*)q);
+	return v.type == SU_NIL ? v : seq_rest(s, &v);
 }
 
-const seq_class_t it_vt = {&it_vector_first, &it_vector_rest};
-
-value_t it_create_vector(su_state *s, vector_t *vec) {
-	value_t v;
-	it_seq_t *it;
-	
-	if (vec->cnt == 0) {
-		v.type = SU_NIL;
-		return v;
-	}
-	
-	it = (it_seq_t*)su_allocate(s, NULL, sizeof(it_seq_t));
-	it->idx = 0;
-	it->obj = (gc_t*)vec;
-	it->q.vt = &it_vt;
-	
-	v.type = IT_SEQ;
-	v.obj.gc_object = gc_insert_object(s, &it->q.gc, IT_SEQ);
-	return v;
-}
+const seq_class_t lazy_vt = {&lazy_first, &lazy_rest};
 
-value_t it_create_string(su_state *s, string_t *str) {
+value_t lazy_create(su_state *s, value_t *thunk) {
 	value_t v;
-	it_seq_t *it;
+	lazy_seq_t *lz = (lazy_seq_t*)gc_allocate(s, sizeof(lazy_seq_t), LAZY_SEQ);
+	lz->q.vt = &lazy_vt;
+	lz->thunk = *thunk;
+	lz->seq.type = SU_NIL;
 	
-	if (str->size <= 1) {
-		v.type = SU_NIL;
-		return v;
-	}
-	
-	it = (it_seq_t*)su_allocate(s, NULL, sizeof(it_seq_t));
-	it->idx = 0;
-	it->obj = (gc_t*)str;
-	it->q.vt = &it_vt;
-	
-	v.type = IT_SEQ;
-	v.obj.gc_object = gc_insert_object(s, &it->q.gc, IT_SEQ);
+	v.type = LAZY_SEQ;
+	v.obj.gc_object = &lz->q.gc;
 	return v;
 }
 
-value_t seq_first(su_state *s, seq_t *q) {
-	return q->vt->first(s, q);
-}
-
-value_t seq_rest(su_state *s, seq_t *q) {
-	return q->vt->rest(s, q);
-}
-
 /* --------------------------------- Vector implementation --------------------------------- */
 
-#define tailoff(v) ((v)->cnt - (v)->tail->len)
+/* A tail buffer can be shared by several vectors, so its length is not the tail count. */
+#define tailoff(v) ((v)->cnt < 32 ? 0 : (((v)->cnt - 1) >> 5) << 5)
+#define tailcnt(v) ((v)->cnt - tailoff(v))
 
 static vector_node_t *push_tail(su_state *s, int level, vector_node_t *arr, vector_node_t *tail_node, vector_node_t **expansion);
 static vector_node_t *insert(su_state *s, int level, vector_node_t *arr, int i, value_t *val);
 static vector_node_t *pop_tail(su_state *s, int shift, vector_node_t *arr, vector_node_t **ptail);
 
-static vector_node_t *node_create_only(su_state *s, int len) {
-	vector_node_t *node = (vector_node_t*)su_allocate(s, NULL, (sizeof(vector_node_t) + sizeof(value_t) * len) - sizeof(value_t));
+static vector_node_t *node_create(su_state *s, int len, int cap, gc_t *edit) {
+	vector_node_t *node = (vector_node_t*)gc_allocate(s, (sizeof(vector_node_t) + sizeof(value_t) * cap) - sizeof(value_t), VECTOR_NODE);
 	node->len = (unsigned char)len;
-	gc_insert_object(s, (gc_t*)node, VECTOR_NODE);
+	node->cap = (unsigned char)cap;
+	node->edit = edit;
 	return node;
 }
 
+static vector_node_t *node_create_only(su_state *s, int len) {
+	return node_create(s, len, len, 0);
+}
+
+/* Inner nodes owned by a transient always have room for a full 32 slots. */
+static vector_node_t *node_create_edit(su_state *s, int len, gc_t *edit) {
+	return node_create(s, len, 32, edit);
+}
+
+static vector_node_t *node_resize(su_state *s, vector_node_t *src, int len, int cap, gc_t *edit) {
+	vector_node_t *node = node_create(s, len, cap, edit);
+	memcpy(node->data, src->data, sizeof(value_t) * len);
+	return node;
+}
+
+/* Tails grow by doubling so a run of appends only copies a handful of times. */
+static int tail_capacity(int len) {
+	int cap = 4;
+	while (cap < len)
+		cap <<= 1;
+	return cap;
+}
+
 static vector_node_t *node_create1(su_state *s, value_t *v) {
 	vector_node_t *node = node_create_only(s, 1);
 	node->data[0] = *v;
@@ -204,21 +203,35 @@ static vector_node_t *node_clone(su_state *s, vector_node_t *src) {
 	return node;
 }
 
+static vector_node_t *node_editable(su_state *s, vector_node_t *src, gc_t *edit) {
+	vector_node_t *node;
+	if (src->edit == edit) {
+		gc_barrier(s, &src->gc);
+		return src;
+	}
+	node = node_create_edit(s, src->len, edit);
+	memcpy(node->data, src->data, sizeof(value_t) * src->len);
+	return node;
+}
+
 int vector_length(vector_t *v) {
 	return v->cnt;
 }
 
-value_t vector_index(su_state *s, vector_t *v, int i) {
+vector_node_t *vector_leaf(vector_t *v, int i) {
 	int level;
 	vector_node_t *arr;
-	if (i >= 0 && i < v->cnt) {
-		if (i >= tailoff(v))
-			return v->tail->data[i & 0x01f];
-		arr = v->root;
-		for (level = v->shift; level > 0; level -= 5)
-			arr = arr->data[(i >> level) & 0x01f].obj.vec_node;
-		return arr->data[i & 0x01f];
-	}
+	if (i >= tailoff(v))
+		return v->tail;
+	arr = v->root;
+	for (level = v->shift; level > 0; level -= 5)
+		arr = arr->data[(i >> level) & 0x01f].obj.vec_node;
+	return arr;
+}
+
+value_t vector_index(su_state *s, vector_t *v, int i) {
+	if (i >= 0 && i < v->cnt)
+		return vector_leaf(v, i)->data[i & 0x01f];
 	su_error(s, "Index is out of bounds: %i", i);
 	return *v->root->data;
 }
@@ -227,8 +240,7 @@ value_t vector_create(su_state *s, unsigned cnt, int shift, vector_node_t *root,
 	vector_t *vec;
 	value_t v;
 	v.type = SU_VECTOR;
-	v.obj.gc_object = (gc_t*)su_allocate(s, NULL, sizeof(vector_t));
-	gc_insert_object(s, v.obj.gc_object, SU_VECTOR);
+	v.obj.gc_object = gc_allocate(s, sizeof(vector_t), SU_VECTOR);
 	
 	assert(root);
 	assert(tail);
@@ -247,13 +259,20 @@ value_t vector_create_empty(su_state *s) {
 
 value_t vector_push(su_state *s, vector_t *vec, value_t *val) {
 	value_t expansion_value, tmp;
-	vector_node_t *expansion = NULL, *new_root;
+	vector_node_t *expansion = NULL, *new_root, *new_tail;
 	int new_shift = vec->shift;
+	int n = tailcnt(vec);
 	
-	if (vec->tail->len < 32) {
-		vector_node_t *new_tail = node_create_only(s, vec->tail->len + 1);
-		memcpy(new_tail->data, vec->tail->data, sizeof(value_t) * vec->tail->len);
-		new_tail->data[vec->tail->len] = *val;
+	if (n < 32) {
+		/* Only the vector that filled the buffer up to its length may claim the next slot. */
+		if (vec->tail->len == n && n < vec->tail->cap) {
+			new_tail = vec->tail;
+			gc_barrier(s, &new_tail->gc);
+			new_tail->len++;
+		} else {
+			new_tail = node_resize(s, vec->tail, n + 1, tail_capacity(n + 1), 0);
+		}
+		new_tail->data[n] = *val;
 		return vector_create(s, vec->cnt + 1, vec->shift, vec->root, new_tail);
 	}
 	
@@ -266,7 +285,9 @@ value_t vector_push(su_state *s, vector_t *vec, value_t *val) {
 		new_shift += 5;
 	}
 	
-	return vector_create(s, vec->cnt + 1, new_shift, new_root, node_create1(s, val));
+	new_tail = node_create(s, 1, tail_capacity(1), 0);
+	new_tail->data[0] = *val;
+	return vector_create(s, vec->cnt + 1, new_shift, new_root, new_tail);
 }
 
 static vector_node_t *push_tail(su_state *s, int level, vector_node_t *arr, vector_node_t *tail_node, vector_node_t **expansion) {
@@ -309,8 +330,7 @@ value_t vector_set(su_state *s, vector_t *vec, int i, value_t *val) {
 	vector_node_t *new_tail;
 	if (i >= 0 && i < vec->cnt) {
 		if (i >= tailoff(vec)) {
-			new_tail = node_create_only(s, vec->tail->len);
-			memcpy(new_tail->data, vec->tail->data, sizeof(value_t) * vec->tail->len);
+			new_tail = node_resize(s, vec->tail, tailcnt(vec), tailcnt(vec), 0);
 			new_tail->data[i & 0x01f] = *val;
 			return vector_create(s, vec->cnt, vec->shift, vec->root, new_tail);
 		}
@@ -336,7 +356,7 @@ static vector_node_t *insert(su_state *s, int level, vector_node_t *arr, int i,
 }
 
 value_t vector_pop(su_state *s, vector_t *vec) {
-	vector_node_t *new_tail, *new_root;
+	vector_node_t *new_root;
 	vector_node_t *ptail = NULL;
 	int new_shift = vec->shift;
 	
@@ -345,11 +365,8 @@ value_t vector_pop(su_state *s, vector_t *vec) {
 	if (vec->cnt == 1)
 		return vector_create_empty(s);
 	
-	if (vec->tail->len > 1) {
-		new_tail = node_create_only(s, vec->tail->len - 1);
-		memcpy(new_tail->data, vec->tail->data, sizeof(value_t) * new_tail->len);
-		return vector_create(s, vec->cnt - 1, vec->shift, vec->root, new_tail);
-	}
+	if (tailcnt(vec) > 1)
+		return vector_create(s, vec->cnt - 1, vec->shift, vec->root, vec->tail);
 
 	new_root = pop_tail(s, vec->shift - 5, vec->root, &ptail);
 	if (!new_root)
@@ -391,22 +408,153 @@ static vector_node_t *pop_tail(su_state *s, int shift, vector_node_t *arr, vecto
 	return ret;
 }
 
+/* Transient vectors mutate the nodes stamped with their edit id in place. */
+
+static vector_node_t *new_path(su_state *s, int level, vector_node_t *node, gc_t *edit) {
+	value_t tmp;
+	vector_node_t *ret;
+	if (level == 0)
+		return node;
+	ret = node_create_edit(s, 1, edit);
+	tmp.type = VECTOR_NODE;
+	tmp.obj.vec_node = new_path(s, level - 5, node, edit);
+	ret->data[0] = tmp;
+	return ret;
+}
+
+static vector_node_t *push_tail_transient(su_state *s, int cnt, int level, vector_node_t *arr, vector_node_t *tail_node, gc_t *edit) {
+	value_t tmp;
+	int subidx = ((cnt - 1) >> level) & 0x01f;
+	vector_node_t *ret = node_editable(s, arr, edit);
+	
+	tmp.type = VECTOR_NODE;
+	if (level == 5)
+		tmp.obj.vec_node = tail_node;
+	else if (subidx < ret->len)
+		tmp.obj.vec_node = push_tail_transient(s, cnt, level - 5, ret->data[subidx].obj.vec_node, tail_node, edit);
+	else
+		tmp.obj.vec_node = new_path(s, level - 5, tail_node, edit);
+	
+	ret->data[subidx] = tmp;
+	if (subidx == ret->len)
+		ret->len++;
+	return ret;
+}
+
+static vector_node_t *insert_transient(su_state *s, gc_t *edit, int level, vector_node_t *arr, int i, value_t *val) {
+	int subidx;
+	value_t tmp;
+	vector_node_t *ret = node_editable(s, arr, edit);
+	if (level == 0) {
+		ret->data[i & 0x01f] = *val;
+	} else {
+		subidx = (i >> level) & 0x01f;
+		tmp.type = VECTOR_NODE;
+		tmp.obj.vec_node = insert_transient(s, edit, level - 5, arr->data[subidx].obj.vec_node, i, val);
+		ret->data[subidx] = tmp;
+	}
+	return ret;
+}
+
+value_t vector_transient(su_state *s, vector_t *vec, gc_t *edit) {
+	return vector_create(s, vec->cnt, vec->shift, vec->root, vec->tail);
+}
+
+void vector_push_transient(su_state *s, vector_t *vec, gc_t *edit, value_t *val) {
+	value_t tmp;
+	vector_node_t *tail_node;
+	int n = tailcnt(vec);
+	
+	gc_barrier(s, &vec->gc);
+	if (n < 32) {
+		if (vec->tail->edit != edit || n == vec->tail->cap)
+			vec->tail = node_resize(s, vec->tail, n, tail_capacity(n + 1), edit);
+		gc_barrier(s, &vec->tail->gc);
+		vec->tail->data[n] = *val;
+		vec->tail->len = (unsigned char)(n + 1);
+		vec->cnt++;
+		return;
+	}
+	
+	tail_node = vec->tail;
+	if ((vec->cnt >> 5) > (1 << vec->shift)) {
+		tmp.type = VECTOR_NODE;
+		tmp.obj.vec_node = vec->root;
+		vec->root = node_create_edit(s, 2, edit);
+		vec->root->data[0] = tmp;
+		tmp.obj.vec_node = new_path(s, vec->shift, tail_node, edit);
+		vec->root->data[1] = tmp;
+		vec->shift += 5;
+	} else {
+		vec->root = push_tail_transient(s, vec->cnt, vec->shift, vec->root, tail_node, edit);
+	}
+	
+	vec->tail = node_create(s, 1, tail_capacity(1), edit);
+	vec->tail->data[0] = *val;
+	vec->cnt++;
+}
+
+void vector_set_transient(su_state *s, vector_t *vec, gc_t *edit, int i, value_t *val) {
+	if (i >= 0 && i < vec->cnt) {
+		gc_barrier(s, &vec->gc);
+		if (i >= tailoff(vec)) {
+			if (vec->tail->edit != edit)
+				vec->tail = node_resize(s, vec->tail, tailcnt(vec), tail_capacity(tailcnt(vec)), edit);
+			gc_barrier(s, &vec->tail->gc);
+			vec->tail->data[i & 0x01f] = *val;
+		} else {
+			vec->root = insert_transient(s, edit, vec->shift, vec->root, i, val);
+		}
+		return;
+	}
+	su_error(s, "Index is out of bounds: %i", i);
+}
+
+void vector_pop_transient(su_state *s, vector_t *vec, gc_t *edit) {
+	vector_t *tmp;
+	int n = tailcnt(vec);
+	if (n > 1) {
+		if (vec->tail->edit == edit)
+			vec->tail->len = (unsigned char)(n - 1);
+		vec->cnt--;
+		return;
+	}
+	
+	/* Popping across a leaf boundary is rare enough to take the persistent path. */
+	tmp = vector_pop(s, vec).obj.vec;
+	gc_barrier(s, &vec->gc);
+	vec->cnt = tmp->cnt;
+	vec->shift = tmp->shift;
+	vec->root = tmp->root;
+	vec->tail = tmp->tail;
+}
+
 /* --------------------------------- HashMap implementation --------------------------------- */
 
-#define CAST_AND_TEST(t, f) t *thiz = (t*)n; assert(n->gc.type == (f))
-#define xmemcpy(dest, doff, src, soff, num) memcpy((void*)(((char*)(dest))+(doff)),(void*)(((char*)(src))+(soff)),(num))
+/*
+	Compressed hash-array mapped prefix tree (CHAMP). A node keeps its key/value
+	pairs first and its sub-nodes last, in reverse order, in one array. 'datamap'
+	tells which hash fragments have a pair and 'nodemap' which have a sub-node.
+	When the hash is used up, keys with equal hashes go into a collision node
+	that is a plain array of pairs.
+	
+	Small maps skip the tree, the root is an array node holding up to
+	MAP_ARRAY_MAX pairs that are found by a linear scan without hashing the key.
+	It is promoted to a tree node when it grows past that.
+*/
+
+#define MAP_ARRAY_MAX 8
 
 #define MASK(h, s) (((h) >> (s)) & 0x01f)
-#define BITPOS(h, s) (1 << MASK((h), (s)))
+#define BITPOS(h, s) (1u << MASK((h), (s)))
+#define HASH_BITS 32
 
-static node_t *create_leaf_node(su_state *s, int hash, value_t *key, value_t *val);
-static node_t *create_collision_node(su_state *s, int hash, vector_node_t *leaves);
-static node_t *create_full_node(su_state *s, vector_node_t *nodes, int shift);
-static node_t *create_idx_node(su_state *s, int bitmap, vector_node_t *nodes, int shift);
-static node_t *create_idx_node2(su_state *s, int bitmap, vector_node_t *nodes, int shift);
-static node_t *create_idx_node3(su_state *s, int shift, node_t *branch, int hash, value_t *key, value_t *val, node_t **added_leaf);
+#define data_index(n, bit) (bit_count((n)->datamap & ((bit) - 1)) * 2)
+#define node_index(n, bit) ((n)->len - 1 - bit_count((n)->nodemap & ((bit) - 1)))
+#define data_len(n) ((n)->gc.type != MAP_NODE ? (n)->len : bit_count((n)->datamap) * 2)
+#define single_pair(n) ((n)->nodemap == 0 && (n)->len == 2)
 
-static int bit_count(int x)
+static int bit_count(unsigned x)
 {
 	#ifdef __GNUC__
 		return __builtin_popcount(x);
@@ -416,529 +564,717 @@ static int bit_count(int x)
 		x = (x & 0x0f0f0f0f) + ((x >> 4) & 0x0f0f0f0f);
 		x = (x & 0x00ff00ff) + ((x >> 8) & 0x00ff00ff);
 		x = (x & 0x0000ffff) + ((x >> 16)& 0x0000ffff);
-		return x;
+		return (int)x;
 	#endif
 }
 
-/* Full node */
+static node_t *map_node_create(su_state *s, int type, int len, int cap, gc_t *edit) {
+	node_t *n = (node_t*)gc_allocate(s, sizeof(node_t) + sizeof(value_t) * (cap > 0 ? cap - 1 : 0), type);
+	n->datamap = 0;
+	n->nodemap = 0;
+	n->edit = edit;
+	n->len = (unsigned short)len;
+	n->cap = (unsigned short)(cap > 0 ? cap : 1);
+	return n;
+}
 
-static node_t *full_node_set(su_state *s, node_t *n, int shift, int hash, value_t *key, value_t *val, node_t **added_leaf) {
-	int idx;
-	node_t *tmp;
-	value_t v;
-	vector_node_t *new_nodes;
-	CAST_AND_TEST(node_full_t, MAP_FULL);
-	
-	idx = MASK(hash, shift);
-	tmp = thiz->nodes->data[idx].obj.map_node;
-	tmp = tmp->vt->set(s, tmp, shift + 5, hash, key, val, added_leaf);
-	if (tmp == thiz->nodes->data[idx].obj.map_node) {
+/* Returns a node that can be written to and has room for len slots, that is n itself if the transient owns it. */
+static node_t *map_node_writable(su_state *s, node_t *n, int len, gc_t *edit) {
+	node_t *c;
+	if (edit && n->edit == edit && len <= n->cap) {
+		gc_barrier(s, &n->gc);
 		return n;
-	} else {
-		new_nodes = node_clone(s, thiz->nodes);
-		v.type = tmp->gc.type;
-		v.obj.map_node = tmp;
-		new_nodes->data[idx] = v;
-		return create_full_node(s, new_nodes, shift);
 	}
+	
+	c = map_node_create(s, n->gc.type, n->len, edit ? len + 4 : len, edit);
+	c->datamap = n->datamap;
+	c->nodemap = n->nodemap;
+	memcpy(c->slots, n->slots, sizeof(value_t) * n->len);
+	return c;
 }
 
-static node_t *full_node_without(su_state *s, node_t *n, int hash, value_t *key) {
-	int idx;
-	value_t v;
-	node_t *tmp;
-	vector_node_t *new_nodes;
-	CAST_AND_TEST(node_full_t, MAP_FULL);
-	
-	idx = MASK(hash, thiz->shift);
-	tmp = thiz->nodes->data[idx].obj.map_node;
-	tmp = tmp->vt->without(s, tmp, hash, key);
-	if (tmp != thiz->nodes->data[idx].obj.map_node) {
-		if (!tmp) {
-			new_nodes = node_create_only(s, thiz->nodes->len - 1);
-			memcpy(new_nodes->data, thiz->nodes->data, sizeof(value_t) * idx);
-			xmemcpy(new_nodes->data, sizeof(value_t) * idx, thiz->nodes->data, sizeof(value_t) * (idx + 1), sizeof(value_t) * (thiz->nodes->len - (idx + 1)));
-			return create_idx_node(s, ~BITPOS(hash, thiz->shift), new_nodes, thiz->shift);
-		}
-		
-		new_nodes = node_clone(s, thiz->nodes);
-		v.type = tmp->gc.type;
-		v.obj.map_node = tmp;
-		new_nodes->data[idx] = v;
-		return create_full_node(s, new_nodes, thiz->shift);
-	}
-	return n;
+static void slots_insert(node_t *n, int i, int num) {
+	memmove(&n->slots[i + num], &n->slots[i], sizeof(value_t) * (n->len - i));
+	n->len += num;
 }
 
-static node_leaf_t *full_node_find(su_state *s, node_t *n, int hash, value_t *key) {
-	node_t *tmp;
-	CAST_AND_TEST(node_full_t, MAP_FULL);
-	tmp = thiz->nodes->data[MASK(hash, thiz->shift)].obj.map_node;
-	return tmp->vt->find(s, tmp, hash, key);
+static void slots_remove(node_t *n, int i, int num) {
+	memmove(&n->slots[i], &n->slots[i + num], sizeof(value_t) * (n->len - i - num));
+	n->len -= num;
 }
 
-static int full_node_get_hash(su_state *s, node_t *n) {
-	CAST_AND_TEST(node_full_t, MAP_FULL);
-	return thiz->hash;
+static void set_sub_node(value_t *slot, node_t *n) {
+	slot->type = n->gc.type;
+	slot->obj.map_node = n;
 }
 
-const node_class_t full_vt = {
-	&full_node_set,
-	&full_node_without,
-	&full_node_find,
-	&full_node_get_hash
-};
-
-static node_t *create_full_node(su_state *s, vector_node_t *nodes, int shift) {
-	node_t *tmp, *n;
-	node_full_t *fn = (node_full_t*)su_allocate(s, NULL, sizeof(node_full_t));
-	fn->nodes = nodes;
-	fn->shift = shift;
-	tmp = nodes->data[0].obj.map_node;
-	fn->hash = tmp->vt->get_hash(s, tmp);
+static node_t *merge_pairs(su_state *s, unsigned shift, value_t *k1, value_t *v1, unsigned h1, value_t *k2, value_t *v2, unsigned h2, gc_t *edit) {
+	node_t *n;
+	unsigned b1, b2;
+	
+	if (shift >= HASH_BITS) {
+		n = map_node_create(s, MAP_COLLISION, 4, 4, edit);
+		n->slots[0] = *k1; n->slots[1] = *v1;
+		n->slots[2] = *k2; n->slots[3] = *v2;
+		return n;
+	}
+	
+	b1 = BITPOS(h1, shift);
+	b2 = BITPOS(h2, shift);
+	if (b1 == b2) {
+		n = map_node_create(s, MAP_NODE, 1, 1, edit);
+		n->nodemap = b1;
+		set_sub_node(&n->slots[0], merge_pairs(s, shift + 5, k1, v1, h1, k2, v2, h2, edit));
+		return n;
+	}
 	
-	n = (node_t*)fn;
-	n->vt = &full_vt;
-	return (node_t*)gc_insert_object(s, (gc_t*)n, MAP_FULL);
+	n = map_node_create(s, MAP_NODE, 4, 4, edit);
+	n->datamap = b1 | b2;
+	if (b1 > b2) {
+		n->slots[0] = *k2; n->slots[1] = *v2;
+		n->slots[2] = *k1; n->slots[3] = *v1;
+	} else {
+		n->slots[0] = *k1; n->slots[1] = *v1;
+		n->slots[2] = *k2; n->slots[3] = *v2;
+	}
+	return n;
 }
 
-/* Index node */
-
-static int idx_node_index(node_t *n, int bit) {
-	CAST_AND_TEST(node_idx_t, MAP_IDX);
-	return bit_count(thiz->bitmap & (bit - 1));
+static node_t *pairs_set(su_state *s, node_t *n, value_t *key, value_t *val, int *added, gc_t *edit) {
+	int i;
+	for (i = 0; i < n->len; i += 2) {
+		if (value_eq(&n->slots[i], key)) {
+			if (value_eq(&n->slots[i + 1], val))
+				return n;
+			n = map_node_writable(s, n, n->len, edit);
+			n->slots[i + 1] = *val;
+			return n;
+		}
+	}
+	
+	*added = 1;
+	n = map_node_writable(s, n, n->len + 2, edit);
+	n->slots[n->len] = *key;
+	n->slots[n->len + 1] = *val;
+	n->len += 2;
+	return n;
 }
 
-static node_t *idx_node_set(su_state *s, node_t *n, int shift, int hash, value_t *key, value_t *val, node_t **added_leaf) {
-	int bit, idx;
-	node_t *tmp;
-	value_t v;
-	vector_node_t *new_nodes;
-	CAST_AND_TEST(node_idx_t, MAP_IDX);
+static node_t *node_set(su_state *s, node_t *n, unsigned shift, unsigned hash, value_t *key, value_t *val, int *added, gc_t *edit) {
+	int i;
+	node_t *sub, *w;
+	unsigned bit;
+	
+	if (n->gc.type == MAP_COLLISION)
+		return pairs_set(s, n, key, val, added, edit);
+	
 	bit = BITPOS(hash, shift);
-	idx = idx_node_index(n, bit);
+	if (n->datamap & bit) {
+		i = data_index(n, bit);
+		if (value_eq(&n->slots[i], key)) {
+			if (value_eq(&n->slots[i + 1], val))
+				return n;
+			w = map_node_writable(s, n, n->len, edit);
+			w->slots[i + 1] = *val;
+			return w;
+		}
+		
+		/* Two different keys share this fragment, push both down one level. */
+		*added = 1;
+		sub = merge_pairs(s, shift + 5, &n->slots[i], &n->slots[i + 1], hash_value(&n->slots[i]), key, val, hash, edit);
+		w = map_node_writable(s, n, n->len, edit);
+		slots_remove(w, i, 2);
+		w->datamap &= ~bit;
+		w->nodemap |= bit;
+		i = node_index(w, bit) + 1;
+		slots_insert(w, i, 1);
+		set_sub_node(&w->slots[i], sub);
+		return w;
+	}
 	
-	if ((thiz->bitmap & bit) != 0) {
-		tmp = thiz->nodes->data[idx].obj.map_node;
-		tmp = tmp->vt->set(s, tmp, shift + 5, hash, key, val, added_leaf);
-		if (tmp == thiz->nodes->data[idx].obj.map_node) {
+	if (n->nodemap & bit) {
+		i = node_index(n, bit);
+		sub = n->slots[i].obj.map_node;
+		sub = node_set(s, sub, shift + 5, hash, key, val, added, edit);
+		if (sub == n->slots[i].obj.map_node)
 			return n;
-		} else {
-			new_nodes = node_clone(s, thiz->nodes);
-			v.type = VECTOR_NODE;
-			v.obj.map_node = tmp;
-			new_nodes->data[idx] = v;
-			return create_idx_node(s, thiz->bitmap, new_nodes, shift);
-		}
-	} else {
-		new_nodes = node_create_only(s, thiz->nodes->len + 1);
-		memcpy(new_nodes->data, thiz->nodes->data, sizeof(value_t) * idx);
-		*added_leaf = new_nodes->data[idx].obj.map_node = create_leaf_node(s, hash, key, val);
-		new_nodes->data[idx].type = (*added_leaf)->gc.type;
-		xmemcpy(new_nodes->data, sizeof(value_t) * (idx + 1), thiz->nodes->data, sizeof(value_t) * idx, sizeof(value_t) * (thiz->nodes->len - idx));
-		return create_idx_node2(s, thiz->bitmap | bit, new_nodes, shift);
+		w = map_node_writable(s, n, n->len, edit);
+		set_sub_node(&w->slots[i], sub);
+		return w;
 	}
+	
+	*added = 1;
+	i = data_index(n, bit);
+	w = map_node_writable(s, n, n->len + 2, edit);
+	slots_insert(w, i, 2);
+	w->slots[i] = *key;
+	w->slots[i + 1] = *val;
+	w->datamap |= bit;
+	return w;
 }
 
-static node_t *idx_node_without(su_state *s, node_t *n, int hash, value_t *key) {
-	int bit, idx;
-	node_t *tmp;
-	value_t v;
-	vector_node_t *new_nodes;
-	CAST_AND_TEST(node_idx_t, MAP_IDX);
-	bit = BITPOS(hash, thiz->shift);
-	
-	if ((thiz->bitmap & bit) != 0) {
-		idx = idx_node_index(n, bit);
-		tmp = thiz->nodes->data[idx].obj.map_node;
-		tmp = tmp->vt->without(s, tmp, hash, key);
-		if (tmp != thiz->nodes->data[idx].obj.map_node) {
-			if (!tmp) {
-				if (thiz->bitmap == bit)
-					return NULL;
-
-				new_nodes = node_create_only(s, thiz->nodes->len - 1);
-				memcpy(new_nodes->data, thiz->nodes->data, sizeof(value_t) * idx);
-				xmemcpy(new_nodes->data, sizeof(value_t) * idx, thiz->nodes->data, sizeof(value_t) * (idx + 1), sizeof(value_t) * (thiz->nodes->len - (idx + 1)));
-				return create_idx_node(s, thiz->bitmap & ~bit, new_nodes, thiz->shift);
-			}
-			new_nodes = node_clone(s, thiz->nodes);
-			v.type = tmp->gc.type;
-			v.obj.map_node = tmp;
-			new_nodes->data[idx] = v;
-			return create_idx_node(s, thiz->bitmap, new_nodes, thiz->shift);
+static node_t *pairs_without(su_state *s, node_t *n, value_t *key, int *removed, gc_t *edit) {
+	int i;
+	for (i = 0; i < n->len; i += 2) {
+		if (value_eq(&n->slots[i], key)) {
+			*removed = 1;
+			n = map_node_writable(s, n, n->len, edit);
+			slots_remove(n, i, 2);
+			return n;
 		}
 	}
 	return n;
 }
 
-static node_leaf_t *idx_node_find(su_state *s, node_t *n, int hash, value_t *key) {
-	int bit;
-	node_t *tmp;
-	CAST_AND_TEST(node_idx_t, MAP_IDX);
-	bit = BITPOS(hash, thiz->shift);
-	if ((thiz->bitmap & bit) != 0) {
-		tmp = thiz->nodes->data[idx_node_index(n, bit)].obj.map_node;
-		return tmp->vt->find(s, tmp, hash, key);
-	} else {
-		return NULL;
+/* A sub-node left with a single pair is inlined into its parent, so the tree stays canonical. */
+static node_t *node_without(su_state *s, node_t *n, unsigned shift, unsigned hash, value_t *key, int *removed, gc_t *edit) {
+	int i, j;
+	node_t *sub, *w;
+	unsigned bit;
+	
+	if (n->gc.type == MAP_COLLISION)
+		return pairs_without(s, n, key, removed, edit);
+	
+	bit = BITPOS(hash, shift);
+	if (n->datamap & bit) {
+		i = data_index(n, bit);
+		if (!value_eq(&n->slots[i], key))
+			return n;
+		*removed = 1;
+		w = map_node_writable(s, n, n->len, edit);
+		slots_remove(w, i, 2);
+		w->datamap &= ~bit;
+		return w;
 	}
+	
+	if (n->nodemap & bit) {
+		i = node_index(n, bit);
+		sub = n->slots[i].obj.map_node;
+		sub = node_without(s, sub, shift + 5, hash, key, removed, edit);
+		if (sub == n->slots[i].obj.map_node)
+			return n;
+		
+		if (!single_pair(sub)) {
+			w = map_node_writable(s, n, n->len, edit);
+			set_sub_node(&w->slots[i], sub);
+			return w;
+		}
+		
+		w = map_node_writable(s, n, n->len + 1, edit);
+		slots_remove(w, i, 1);
+		w->nodemap &= ~bit;
+		j = data_index(w, bit);
+		slots_insert(w, j, 2);
+		w->slots[j] = sub->slots[0];
+		w->slots[j + 1] = sub->slots[1];
+		w->datamap |= bit;
+		return w;
+	}
+	return n;
 }
 
-static int idx_node_get_hash(su_state *s, node_t *n) {
-	CAST_AND_TEST(node_idx_t, MAP_IDX);
-	return thiz->hash;
+static value_t *pairs_find(node_t *n, value_t *key) {
+	int i;
+	for (i = 0; i < n->len; i += 2) {
+		if (value_eq(&n->slots[i], key))
+			return &n->slots[i];
+	}
+	return NULL;
 }
 
-const node_class_t idx_vt = {
-	&idx_node_set,
-	&idx_node_without,
-	&idx_node_find,
-	&idx_node_get_hash
-};
-
-static node_t *create_idx_node(su_state *s, int bitmap, vector_node_t *nodes, int shift) {
-	node_t *n;
-	node_t *tmp;
-	node_idx_t *in = (node_idx_t*)su_allocate(s, NULL, sizeof(node_idx_t));
-	in->bitmap = bitmap;
-	in->shift = shift;
-	in->nodes = nodes;
-	tmp = nodes->data[0].obj.map_node;
-	in->hash = tmp->vt->get_hash(s, tmp);
+/* Walks down the tree in a loop, the bitmaps pick the slot so only one node is touched per level. */
+static value_t *node_find(node_t *n, unsigned hash, value_t *key) {
+	int i;
+	unsigned bit, shift = 0;
 	
-	n = (node_t*)in;
-	n->vt = &idx_vt;
-	return (node_t*)gc_insert_object(s, (gc_t*)n, MAP_IDX);
+	while (n->gc.type == MAP_NODE) {
+		bit = BITPOS(hash, shift);
+		if (n->datamap & bit) {
+			i = data_index(n, bit);
+			return value_eq(&n->slots[i], key) ? &n->slots[i] : NULL;
+		}
+		if (!(n->nodemap & bit))
+			return NULL;
+		
+		n = n->slots[node_index(n, bit)].obj.map_node;
+		shift += 5;
+	}
+	return pairs_find(n, key);
 }
 
-static node_t *create_idx_node2(su_state *s, int bitmap, vector_node_t *nodes, int shift) {
-	if (bitmap == -1)
-		return create_full_node(s, nodes, shift);
-	return create_idx_node(s, bitmap, nodes, shift);
+/* Map functions */
+
+/* Moves the pairs of an array node into a tree. */
+static node_t *array_promote(su_state *s, node_t *n, gc_t *edit) {
+	int i, added = 0;
+	node_t *root = map_node_create(s, MAP_NODE, 0, 0, edit);
+	for (i = 0; i < n->len; i += 2)
+		root = node_set(s, root, 0, hash_value(&n->slots[i]), &n->slots[i], &n->slots[i + 1], &added, edit);
+	return root;
 }
 
-static node_t *create_idx_node3(su_state *s, int shift, node_t *branch, int hash, value_t *key, value_t *val, node_t **added_leaf) {
-	value_t v;
-	vector_node_t *vec;
-	node_t *n;
+static node_t *root_set(su_state *s, node_t *root, value_t *key, value_t *val, int *added, gc_t *edit) {
+	if (root->gc.type != MAP_ARRAY)
+		return node_set(s, root, 0, hash_value(key), key, val, added, edit);
 	
-	v.type = branch->gc.type;
-	v.obj.map_node = branch;
-	vec = node_create1(s, &v);
+	if (root->len < MAP_ARRAY_MAX * 2 || pairs_find(root, key))
+		return pairs_set(s, root, key, val, added, edit);
 	
-	n = create_idx_node(s, BITPOS(branch->vt->get_hash(s, branch), shift), vec, shift);
-	return n->vt->set(s, n, shift, hash, key, val, added_leaf);
+	/* A persistent map gets a fresh edit, so the new tree is built in place. */
+	if (!edit)
+		edit = transient_edit(s);
+	root = array_promote(s, root, edit);
+	return node_set(s, root, 0, hash_value(key), key, val, added, edit);
 }
 
-/* Collision node */
+static node_t *root_without(su_state *s, node_t *root, value_t *key, int *removed, gc_t *edit) {
+	if (root->gc.type == MAP_ARRAY)
+		return pairs_without(s, root, key, removed, edit);
+	return node_without(s, root, 0, hash_value(key), key, removed, edit);
+}
 
-static int collision_node_find_index(su_state *s, node_t *n, int hash, value_t *key) {
-	int i;
-	node_t *tmp;
-	CAST_AND_TEST(node_collision_t, MAP_COLLISION);
-	for (i = 0; i < thiz->leaves->len; i++) {
-		tmp = thiz->leaves->data[i].obj.map_node;
-		if (tmp->vt->find(s, tmp, hash, key))
-			return i;
-	}
-	return -1;
+static value_t map_create(su_state *s, int cnt, node_t *root) {
+	value_t v;
+	map_t *m = (map_t*)gc_allocate(s, sizeof(map_t), SU_MAP);
+	m->root = root;
+	m->cnt = cnt;
+	v.type = SU_MAP;
+	v.obj.gc_object = &m->gc;
+	return v;
 }
 
-static node_t *collision_node_set(su_state *s, node_t *n, int shift, int hash, value_t *key, value_t *val, node_t **added_leaf) {
-	int idx;
+value_t map_create_empty(su_state *s) {
+	return map_create(s, 0, map_node_create(s, MAP_ARRAY, 0, 0, 0));
+}
+
+value_t map_get(su_state *s, map_t *m, value_t *key) {
 	value_t v;
-	vector_node_t *new_leaves;
-	CAST_AND_TEST(node_collision_t, MAP_COLLISION);
+	value_t *kv;
 	
-	if (hash == thiz->hash) {
-		idx = collision_node_find_index(s, n, hash, key);
-		if (idx != -1) {
-			if (value_eq(&thiz->leaves->data[idx], val))
-				return n;
-			
-			new_leaves = node_clone(s, thiz->leaves);
-			v.type = MAP_LEAF;
-			v.obj.map_node = (node_t*)create_leaf_node(s, hash, key, val);
-			new_leaves->data[idx] = v;
-			return create_collision_node(s, hash, new_leaves);
-		}
-		
-		new_leaves = node_create_only(s, thiz->leaves->len + 1);
-		memcpy(new_leaves->data, thiz->leaves->data, sizeof(value_t) * thiz->leaves->len);
-		
-		*added_leaf = (node_t*)create_leaf_node(s, hash, key, val);
-		v.obj.map_node = *added_leaf;
-		v.type = v.obj.map_node->gc.type;
-		new_leaves->data[thiz->leaves->len] = v;
-		return create_collision_node(s, hash, new_leaves);
+	if (m->root->gc.type == MAP_ARRAY)
+		kv = pairs_find(m->root, key);
+	else
+		kv = node_find(m->root, hash_value(key), key);
+	
+	if (!kv) {
+		v.type = SU_INV;
+		return v;
 	}
-	return create_idx_node3(s, shift, n, hash, key, val, added_leaf);
+	return kv[1];
 }
 
-static node_t *collision_node_without(su_state *s, node_t *n, int hash, value_t *key) {
-	int idx;
-	vector_node_t *new_leaves;
-	CAST_AND_TEST(node_collision_t, MAP_COLLISION);
-	idx = collision_node_find_index(s, n, hash, key);
-	if (idx == -1)
-		return n;
-	if (thiz->leaves->len == 2)
-		return idx == 0 ? thiz->leaves->data[1].obj.map_node : thiz->leaves->data[0].obj.map_node;
-	
-	new_leaves = node_create_only(s, thiz->leaves->len - 1);
-	memcpy(new_leaves->data, thiz->leaves->data, sizeof(value_t) * idx);
-	xmemcpy(new_leaves->data, sizeof(value_t) * idx, thiz->leaves->data, sizeof(value_t) * (idx + 1), sizeof(value_t) * (thiz->leaves->len - (idx + 1)));
-	return create_collision_node(s, hash, new_leaves);
+value_t map_remove(su_state *s, map_t *m, value_t *key) {
+	value_t v;
+	int removed = 0;
+	node_t *new_root = root_without(s, m->root, key, &removed, 0);
+	if (!removed) {
+		v.type = SU_MAP;
+		v.obj.m = m;
+		return v;
+	}
+	return map_create(s, m->cnt - 1, new_root);
 }
 
-static node_leaf_t *collision_node_find(su_state *s, node_t *n, int hash, value_t *key) {
-	int idx;
-	node_leaf_t *tmp;
-	CAST_AND_TEST(node_collision_t, MAP_COLLISION);
-	idx = collision_node_find_index(s, n, hash, key);
-	if (idx != -1) {
-		tmp = (node_leaf_t*)thiz->leaves->data[idx].obj.map_node;
-		assert(tmp->n.gc.type == MAP_LEAF);
-		return tmp;
+value_t map_insert(su_state *s, map_t *m, value_t *key, value_t *val) {
+	value_t v;
+	int added = 0;
+	node_t *new_root = root_set(s, m->root, key, val, &added, 0);
+	if (new_root == m->root) {
+		v.type = SU_MAP;
+		v.obj.m = m;
+		return v;
 	}
-	return NULL;
+	return map_create(s, m->cnt + added, new_root);
 }
 
-static int collision_node_get_hash(su_state *s, node_t *n) {
-	CAST_AND_TEST(node_collision_t, MAP_COLLISION);
-	return thiz->hash;
+int map_length(map_t *m) {
+	return m->cnt;
 }
 
-const node_class_t collision_vt = {
-	&collision_node_set,
-	&collision_node_without,
-	&collision_node_find,
-	&collision_node_get_hash
-};
+value_t map_transient(su_state *s, map_t *m) {
+	return map_create(s, m->cnt, m->root);
+}
 
-static node_t *create_collision_node(su_state *s, int hash, vector_node_t *leaves) {
-	node_t *n;
-	node_collision_t *cn = (node_collision_t*)su_allocate(s, NULL, sizeof(node_collision_t));
-	cn->hash = hash;
-	cn->leaves = leaves;
-	
-	n = (node_t*)cn;
-	n->vt = &collision_vt;
-	return (node_t*)gc_insert_object(s, (gc_t*)n, MAP_COLLISION);
+void map_insert_transient(su_state *s, map_t *m, gc_t *edit, value_t *key, value_t *val) {
+	int added = 0;
+	gc_barrier(s, &m->gc);
+	m->root = root_set(s, m->root, key, val, &added, edit);
+	m->cnt += added;
 }
 
-/* Leaf node */
+void map_remove_transient(su_state *s, map_t *m, gc_t *edit, value_t *key) {
+	int removed = 0;
+	gc_barrier(s, &m->gc);
+	m->root = root_without(s, m->root, key, &removed, edit);
+	m->cnt -= removed;
+}
 
-static node_t *leaf_node_set(su_state *s, node_t *n, int shift, int hash, value_t *key, value_t *val, node_t **added_leaf) {
-	value_t v, t;
-	CAST_AND_TEST(node_leaf_t, MAP_LEAF);
+void map_iter_init(map_iter_t *it, map_t *m) {
+	it->top = 0;
+	it->nodes[0] = m->root;
+	it->idx[0] = 0;
+}
+
+/* Depth first walk, returns a pointer to the key with the value following it. */
+value_t *map_iter_next(map_iter_t *it) {
+	int i;
+	node_t *n;
 	
-	if (hash == thiz->hash) {
-		if (value_eq(key, &thiz->key)) {
-			if (value_eq(val, &thiz->val))
-				return n;
-			return create_leaf_node(s, hash, key, val);
+	while (it->top >= 0) {
+		n = it->nodes[it->top];
+		i = it->idx[it->top];
+		if (i < data_len(n)) {
+			it->idx[it->top] += 2;
+			return &n->slots[i];
 		}
-		
-		*added_leaf = create_leaf_node(s, hash, key, val);
-		v.type = (*added_leaf)->gc.type;
-		v.obj.map_node = *added_leaf;
-		t.type = n->gc.type;
-		t.obj.map_node = n;
-		
-		return create_collision_node(s, hash, node_create2(s, &t, &v));
+		if (i < n->len) {
+			it->idx[it->top]++;
+			assert(it->top + 1 < MAP_ITER_DEPTH);
+			it->nodes[++it->top] = n->slots[i].obj.map_node;
+			it->idx[it->top] = 0;
+			continue;
+		}
+		it->top--;
 	}
-	return create_idx_node3(s, shift, n, hash, key, val, added_leaf);
+	return NULL;
 }
 
-static node_t *leaf_node_without(su_state *s, node_t *n, int hash, value_t *key) {
-	CAST_AND_TEST(node_leaf_t, MAP_LEAF);
-	if (hash == thiz->hash && value_eq(key, &thiz->key))
-		return NULL;
-	return n;
+/* --------------------------------- Transient implementation --------------------------------- */
+
+/*
+	An edit is a small object of its own. The nodes stamped with it keep it
+	alive, so its address can't be handed out again while any stamp remains.
+*/
+gc_t *transient_edit(su_state *s) {
+	return gc_allocate(s, sizeof(edit_t), EDIT);
 }
 
-static node_leaf_t *leaf_node_find(su_state *s, node_t *n, int hash, value_t *key) {
-	CAST_AND_TEST(node_leaf_t, MAP_LEAF);
-	if(hash == thiz->hash && value_eq(key, &thiz->key))
-		return thiz;
-	return NULL;
+value_t transient_create(su_state *s, value_t *coll) {
+	value_t v;
+	transient_t *t = (transient_t*)gc_allocate(s, sizeof(transient_t), SU_TRANSIENT);
+	t->edit = transient_edit(s);
+	
+	if (coll->type == SU_VECTOR)
+		t->coll = vector_transient(s, coll->obj.vec, t->edit);
+	else
+		t->coll = map_transient(s, coll->obj.m);
+	
+	v.type = SU_TRANSIENT;
+	v.obj.gc_object = &t->gc;
+	return v;
 }
 
-static int leaf_node_get_hash(su_state *s, node_t *n) {
-	CAST_AND_TEST(node_leaf_t, MAP_LEAF);
-	return thiz->hash;
+value_t transient_persistent(su_state *s, transient_t *t) {
+	su_assert(s, t->edit != 0, "Transient used after persistent!");
+	t->edit = 0;
+	return t->coll;
 }
 
-const node_class_t leaf_vt = {
-	&leaf_node_set,
-	&leaf_node_without,
-	&leaf_node_find,
-	&leaf_node_get_hash
-};
+/* --------------------------------- Reduce implementation --------------------------------- */
 
-static node_t *create_leaf_node(su_state *s, int hash, value_t *key, value_t *val) {
-	node_t *n;
-	node_leaf_t *ln = (node_leaf_t*)su_allocate(s, NULL, sizeof(node_leaf_t));
-	ln->hash = hash;
-	ln->key = *key;
-	ln->val = *val;
-	
-	n = (node_t*)ln;
-	n->vt = &leaf_vt;
-	return (node_t*)gc_insert_object(s, (gc_t*)n, MAP_LEAF);
+value_t reduced_create(su_state *s, value_t *val) {
+	value_t v;
+	reduced_t *r = (reduced_t*)gc_allocate(s, sizeof(reduced_t), REDUCED);
+	r->val = *val;
+	v.type = REDUCED;
+	v.obj.gc_object = &r->gc;
+	return v;
 }
 
-/* Empty node */
-
-static node_t *empty_node_set(su_state *s, node_t *n, int shift, int hash, value_t *key, value_t *val, node_t **added_leaf) {
-	node_t *ret = create_leaf_node(s, hash, key, val);
-	CAST_AND_TEST(node_t, MAP_EMPTY);
-	(void)*thiz;
-	*added_leaf = ret;
-	return ret;
+value_t xform_create(su_state *s, int kind, value_t *arg) {
+	value_t v;
+	xform_t *x = (xform_t*)gc_allocate(s, sizeof(xform_t), XFORM);
+	x->kind = kind;
+	x->arg = *arg;
+	v.type = XFORM;
+	v.obj.gc_object = &x->gc;
+	return v;
 }
 
-static node_t *empty_node_without(su_state *s, node_t *n, int hash, value_t *key) {
-	CAST_AND_TEST(node_t, MAP_EMPTY);
-	(void)*thiz;
-	return n;
+/* --------------------------------- String builder implementation --------------------------------- */
+
+value_t builder_create(su_state *s) {
+	value_t v;
+	builder_t *b = (builder_t*)gc_allocate_old(s, sizeof(builder_t), STRING_BUILDER);
+	/* The builder is already in the heap, so it must be safe to free if the buffer can't be allocated. */
+	b->len = 0;
+	b->cap = 0;
+	b->buf = NULL;
+	b->buf = (char*)mem_allocate(s, NULL, 0, 64, SU_ALLOC_STRING);
+	b->cap = 64;
+	b->buf[0] = '\0';
+	v.type = STRING_BUILDER;
+	v.obj.gc_object = &b->gc;
+	return v;
 }
 
-static node_leaf_t *empty_node_find(su_state *s, node_t *n, int hash, value_t *key) {
-	CAST_AND_TEST(node_t, MAP_EMPTY);
-	(void)*thiz;
-	return NULL;
+/* The buffer grows by doubling and always has room for a terminator. */
+void builder_append(su_state *s, builder_t *b, const char *str, unsigned len) {
+	unsigned cap = b->cap;
+	while (b->len + len + 1 > cap)
+		cap *= 2;
+	if (cap != b->cap) {
+		b->buf = (char*)mem_allocate(s, b->buf, b->cap, cap, SU_ALLOC_STRING);
+		b->cap = cap;
+	}
+	memcpy(&b->buf[b->len], str, len);
+	b->len += len;
+	b->buf[b->len] = '\0';
 }
 
-static int empty_node_get_hash(su_state *s, node_t *n) {
-	CAST_AND_TEST(node_t, MAP_EMPTY);
-	(void)*thiz;
-	return 0;
+void builder_append_text(su_state *s, builder_t *b, gc_t *text) {
+	rope_t *r;
+	if (text->type == SU_STRING) {
+		builder_append(s, b, ((string_t*)text)->str, string_len((string_t*)text));
+	} else {
+		r = (rope_t*)text;
+		builder_append_text(s, b, r->left);
+		builder_append_text(s, b, r->right);
+	}
 }
 
-const node_class_t empty_vt = {
-	&empty_node_set,
-	&empty_node_without,
-	&empty_node_find,
-	&empty_node_get_hash
-};
+/* --------------------------------- Rope implementation --------------------------------- */
 
-static node_t *create_empty_node(su_state *s) {
-	node_t *n = (node_t*)su_allocate(s, NULL, sizeof(node_t));
-	n->vt = &empty_vt;
-	return (node_t*)gc_insert_object(s, &n->gc, MAP_EMPTY);
-}
+/*
+	Ropes are kept balanced like AVL trees, the depths of the two pieces of a
+	node differ by at most one. Short pieces are joined into plain strings so
+	the leaves do not get too small.
+*/
 
-/* Map functions */
+#define ROPE_LEAF_MAX 256
 
-static value_t map_create(su_state *s, int cnt, node_t *root) {
-	value_t v;
-	map_t *m = (map_t*)su_allocate(s, NULL, sizeof(map_t));
-	m->root = root;
-	m->cnt = cnt;
-	v.type = SU_MAP;
-	v.obj.gc_object = gc_insert_object(s, (gc_t*)m, SU_MAP);
-	return v;
-}
+#define text_depth(t) ((t)->type == SU_STRING ? 0 : ((rope_t*)(t))->depth)
+#define rope_left(t) (((rope_t*)(t))->left)
+#define rope_right(t) (((rope_t*)(t))->right)
 
-value_t map_create_empty(su_state *s) {
-	return map_create(s, 0, create_empty_node(s));
+unsigned text_length(gc_t *text) {
+	if (text->type == SU_STRING)
+		return string_len((string_t*)text);
+	return ((rope_t*)text)->len;
 }
 
-value_t map_get(su_state *s, map_t *m, value_t *key, unsigned hash) {
-	value_t v;
-	node_leaf_t *n = m->root->vt->find(s, m->root, (int)hash, key);
-	if (!n) {
-		v.type = SU_INV;
-		return v;
+static void text_write(gc_t *text, char *dst) {
+	if (text->type == SU_STRING) {
+		memcpy(dst, ((string_t*)text)->str, string_len((string_t*)text));
+	} else {
+		text_write(rope_left(text), dst);
+		text_write(rope_right(text), dst + text_length(rope_left(text)));
 	}
-	return n->val;
 }
 
-value_t map_remove(su_state *s, map_t *m, value_t *key, unsigned hash) {
-	value_t v;
-	node_t *new_root = m->root->vt->without(s, m->root, (int)hash, key);
-	v.type = SU_MAP;
-	if (new_root == m->root) {
-		v.obj.m = m;
-		return v;
+static gc_t *rope_node(su_state *s, gc_t *left, gc_t *right) {
+	unsigned dl = text_depth(left);
+	unsigned dr = text_depth(right);
+	rope_t *r = (rope_t*)gc_allocate(s, sizeof(rope_t), ROPE);
+	r->left = left;
+	r->right = right;
+	r->len = text_length(left) + text_length(right);
+	r->depth = (dl > dr ? dl : dr) + 1;
+	return &r->gc;
+}
+
+/* Builds a node from pieces whose depths differ by at most two, rotating it back into balance. */
+static gc_t *rope_balance(su_state *s, gc_t *left, gc_t *right) {
+	gc_t *m;
+	unsigned dl = text_depth(left);
+	unsigned dr = text_depth(right);
+	
+	if (dl > dr + 1) {
+		if (text_depth(rope_left(left)) >= text_depth(rope_right(left)))
+			return rope_node(s, rope_left(left), rope_node(s, rope_right(left), right));
+		m = rope_right(left);
+		return rope_node(s, rope_node(s, rope_left(left), rope_left(m)), rope_node(s, rope_right(m), right));
 	}
-	if (!new_root)
-		return map_create_empty(s);
-	return map_create(s, m->cnt - 1, new_root);
+	if (dr > dl + 1) {
+		if (text_depth(rope_right(right)) >= text_depth(rope_left(right)))
+			return rope_node(s, rope_node(s, left, rope_left(right)), rope_right(right));
+		m = rope_left(right);
+		return rope_node(s, rope_node(s, left, rope_left(m)), rope_node(s, rope_right(m), rope_right(right)));
+	}
+	return rope_node(s, left, right);
 }
 
-value_t map_insert(su_state *s, map_t *m, value_t *key, unsigned hash, value_t *val) {
-	value_t v;
-	node_t *added_leaf = NULL;
-	node_t *new_root = m->root->vt->set(s, m->root, 0, (int)hash, key, val, &added_leaf);
-	if (new_root == m->root) {
-		v.type = SU_MAP;
-		v.obj.m = m;
-		return v;
+gc_t *rope_concat(su_state *s, gc_t *a, gc_t *b) {
+	gc_t *str;
+	unsigned la = text_length(a);
+	unsigned lb = text_length(b);
+	
+	if (la == 0) return b;
+	if (lb == 0) return a;
+	
+	if (la + lb <= ROPE_LEAF_MAX) {
+		str = string_create(s, la + lb, NULL);
+		text_write(a, ((string_t*)str)->str);
+		text_write(b, ((string_t*)str)->str + la);
+		return str;
 	}
-	return map_create(s, added_leaf ? m->cnt + 1 : m->cnt, new_root);
+	
+	if (text_depth(a) > text_depth(b) + 1)
+		return rope_balance(s, rope_left(a), rope_concat(s, rope_right(a), b));
+	if (text_depth(b) > text_depth(a) + 1)
+		return rope_balance(s, rope_concat(s, a, rope_left(b)), rope_right(b));
+	return rope_node(s, a, b);
 }
 
-int map_length(map_t *m) {
-	return m->cnt;
+gc_t *rope_slice(su_state *s, gc_t *text, unsigned start, unsigned end) {
+	unsigned split;
+	
+	if (start == 0 && end == text_length(text))
+		return text;
+	
+	if (text->type == SU_STRING)
+		return string_slice(s, (string_t*)text, start, end - start);
+	
+	split = text_length(rope_left(text));
+	if (end <= split)
+		return rope_slice(s, rope_left(text), start, end);
+	if (start >= split)
+		return rope_slice(s, rope_right(text), start - split, end - split);
+	return rope_concat(s, rope_slice(s, rope_left(text), start, split), rope_slice(s, rope_right(text), 0, end - split));
+}
+
+gc_t *rope_flatten(su_state *s, gc_t *text) {
+	gc_t *str;
+	if (text->type == SU_STRING)
+		return text;
+	str = string_create(s, text_length(text), NULL);
+	text_write(text, ((string_t*)str)->str);
+	return str;
 }
 
 /* --------------------------------- Seq implementation --------------------------------- */
 
-static value_t it_seq_create_with_index(su_state *s, gc_t *obj, int idx);
+/*
+	Vector and string seqs keep their position in the value itself, so stepping
+	inside a chunk never allocates. A vector chunk is created once per leaf.
+*/
 
-static value_t it_seq_string_first(su_state *s, seq_t *q) {
+static value_t chunk_create(su_state *s, vector_t *vec, int base) {
 	value_t v;
-	char buffer[2] = {0, 0};
-	it_seq_t *itq = (it_seq_t*)q;
-	string_t *str = (string_t*)itq->obj;
-	v.type = SU_STRING;
-	buffer[0] = str->str[itq->idx];
-	v.obj.gc_object = string_from_db(s, murmur(buffer, 2, 0), 2, buffer);
+	chunk_seq_t *c = (chunk_seq_t*)gc_allocate(s, sizeof(chunk_seq_t), CHUNK_SEQ);
+	c->vec = vec;
+	c->node = vector_leaf(vec, base);
+	c->base = base;
+	
+	v.type = CHUNK_SEQ;
+	v.obj.it.obj = &c->gc;
+	v.obj.it.idx = 0;
 	return v;
 }
 
-static value_t it_seq_string_rest(su_state *s, seq_t *q) {
+value_t it_create_vector(su_state *s, vector_t *vec) {
 	value_t v;
-	it_seq_t *itq = (it_seq_t*)q;
-	v.type = SU_NIL;
-	if (itq->idx + 1 >= ((string_t*)itq->obj)->size)
+	if (vec->cnt == 0) {
+		v.type = SU_NIL;
 		return v;
-	return it_seq_create_with_index(s, itq->obj, itq->idx + 1);
+	}
+	return chunk_create(s, vec, 0);
 }
 
-static value_t it_seq_vector_first(su_state *s, seq_t *q) {
-	it_seq_t *itq = (it_seq_t*)q;
-	return vector_index(s, (vector_t*)itq->obj, itq->idx);
+value_t it_create_string(su_state *s, string_t *str) {
+	value_t v;
+	if (string_len(str) == 0) {
+		v.type = SU_NIL;
+		return v;
+	}
+	v.type = STRING_SEQ;
+	v.obj.it.obj = &str->gc;
+	v.obj.it.idx = 0;
+	return v;
 }
 
-static value_t it_seq_vector_rest(su_state *s, seq_t *q) {
+static value_t string_at(su_state *s, string_t *str, int idx) {
 	value_t v;
-	it_seq_t *itq = (it_seq_t*)q;
-	v.type = SU_NIL;
-	if (itq->idx + 1 >= ((vector_t*)itq->obj)->cnt)
-		return v;
-	return it_seq_create_with_index(s, itq->obj, itq->idx + 1);
+	v.type = SU_STRING;
+	v.obj.gc_object = string_char(s, str->str[idx]);
+	return v;
 }
 
-const seq_class_t seq_string_vt = {&it_seq_string_first, &it_seq_string_rest};
-const seq_class_t seq_vector_vt = {&it_seq_vector_first, &it_seq_vector_rest};
+value_t seq_first(su_state *s, value_t *q) {
+	chunk_seq_t *c;
+	switch (q->type) {
+		case CHUNK_SEQ:
+			c = (chunk_seq_t*)q->obj.it.obj;
+			return c->node->data[q->obj.it.idx];
+		case STRING_SEQ:
+			return string_at(s, (string_t*)q->obj.it.obj, q->obj.it.idx);
+		default:
+			return q->obj.q->vt->first(s, q->obj.q);
+	}
+}
 
-static value_t it_seq_create_with_index(su_state *s, gc_t *obj, int idx) {
+value_t seq_rest(su_state *s, value_t *q) {
 	value_t v;
-	it_seq_t *q = (it_seq_t*)su_allocate(s, NULL, sizeof(it_seq_t));
-	v.type = IT_SEQ;
-	q->obj = obj;
-	q->idx = idx;
-	
-	q->q.vt = v.type == SU_STRING ? &seq_string_vt : &seq_vector_vt;
-	v.obj.gc_object = gc_insert_object(s, &q->q.gc, IT_SEQ);
-	return v;
+	chunk_seq_t *c;
+	switch (q->type) {
+		case CHUNK_SEQ:
+			c = (chunk_seq_t*)q->obj.it.obj;
+			if (q->obj.it.idx + 1 < chunk_len(c)) {
+				v = *q;
+				v.obj.it.idx++;
+				return v;
+			}
+			return seq_chunk_rest(s, q);
+		case STRING_SEQ:
+			v = *q;
+			if (++v.obj.it.idx >= (int)string_len((string_t*)q->obj.it.obj))
+				v.type = SU_NIL;
+			return v;
+		default:
+			return q->obj.q->vt->rest(s, q->obj.q);
+	}
+}
+
+int seq_chunk(su_state *s, value_t *q, value_t *buffer) {
+	int i, n;
+	value_t v;
+	chunk_seq_t *c;
+	string_t *str;
+	switch (q->type) {
+		case LAZY_SEQ:
+			v = lazy_force(s, (lazy_seq_t*)q->obj.q);
+			return v.type == SU_NIL ? 0 : seq_chunk(s, &v, buffer);
+		case CHUNK_SEQ:
+			c = (chunk_seq_t*)q->obj.it.obj;
+			n = chunk_len(c) - q->obj.it.idx;
+			memcpy(buffer, &c->node->data[q->obj.it.idx], sizeof(value_t) * n);
+			return n;
+		case STRING_SEQ:
+			str = (string_t*)q->obj.it.obj;
+			n = (int)string_len(str) - q->obj.it.idx;
+			n = n < 32 ? n : 32;
+			for (i = 0; i < n; i++)
+				buffer[i] = string_at(s, str, q->obj.it.idx + i);
+			return n;
+		default:
+			buffer[0] = seq_first(s, q);
+			return 1;
+	}
 }
 
-value_t it_seq_create(su_state *s, value_t *obj) {
-	return it_seq_create_with_index(s, obj->obj.gc_object, 0);
+value_t seq_chunk_rest(su_state *s, value_t *q) {
+	value_t v;
+	chunk_seq_t *c;
+	string_t *str;
+	switch (q->type) {
+		case LAZY_SEQ:
+			v = lazy_force(s, (lazy_seq_t*)q->obj.q);
+			return v.type == SU_NIL ? v : seq_chunk_rest(s, &v);
+		case CHUNK_SEQ:
+			c = (chunk_seq_t*)q->obj.it.obj;
+			if (c->base + 32 >= c->vec->cnt) {
+				v.type = SU_NIL;
+				return v;
+			}
+			return chunk_create(s, c->vec, c->base + 32);
+		case STRING_SEQ:
+			str = (string_t*)q->obj.it.obj;
+			v = *q;
+			v.obj.it.idx += 32;
+			if (v.obj.it.idx >= (int)string_len(str))
+				v.type = SU_NIL;
+			return v;
+		default:
+			return seq_rest(s, q);
+	}
 }
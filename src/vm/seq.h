@@ -31,6 +31,8 @@
 struct vector_node {
 	gc_t gc;
 	unsigned char len;
+	unsigned char cap;
+	gc_t *edit;
 	value_t data[1];
 };
 
@@ -43,57 +45,28 @@ struct vector {
 };
 
 int vector_length(vector_t *v);
+vector_node_t *vector_leaf(vector_t *v, int i);
 value_t vector_index(su_state *s, vector_t *v, int i);
 value_t vector_create_empty(su_state *s);
 value_t vector_push(su_state *s, vector_t *vec, value_t *val);
 value_t vector_pop(su_state *s, vector_t *vec);
 value_t vector_set(su_state *s, vector_t *vec, int i, value_t *val);
 
-/***********************************************************************************/
-
-typedef node_t* (*node_set_func_t)(su_state *s, node_t *n, int shift, int hash, value_t *key, value_t *val, node_t **added_leaf);
-typedef node_t* (*node_without_func_t)(su_state *s, node_t *n, int hash, value_t *key);
-typedef node_leaf_t* (*node_find_func_t)(su_state *s, node_t *n, int hash, value_t *key);
-typedef int (*node_get_hash_t)(su_state *s, node_t *n);
+value_t vector_transient(su_state *s, vector_t *vec, gc_t *edit);
+void vector_push_transient(su_state *s, vector_t *vec, gc_t *edit, value_t *val);
+void vector_set_transient(su_state *s, vector_t *vec, gc_t *edit, int i, value_t *val);
+void vector_pop_transient(su_state *s, vector_t *vec, gc_t *edit);
 
-typedef struct {
-	node_set_func_t set;
-	node_without_func_t without;
-	node_find_func_t find;
-	node_get_hash_t get_hash;
-} node_class_t;
+/***********************************************************************************/
 
 struct node {
 	gc_t gc;
-	const node_class_t *vt;
-};
-
-struct node_leaf {
-	node_t n;
-	int hash;
-	value_t key;
-	value_t val;
-};
-
-struct node_collision {
-	node_t n;
-	int hash;
-	vector_node_t *leaves;
-};
-
-struct node_idx {
-	node_t n;
-	int bitmap;
-	int shift;
-	int hash;
-	vector_node_t *nodes;
-};
-	
-struct node_full {
-	node_t n;
-	int shift;
-	int hash;
-	vector_node_t *nodes;
+	unsigned datamap;
+	unsigned nodemap;
+	gc_t *edit;
+	unsigned short len;
+	unsigned short cap;
+	value_t slots[1];
 };
 
 struct map {
@@ -103,11 +76,87 @@ struct map {
 };
 
 value_t map_create_empty(su_state *s);
-value_t map_get(su_state *s, map_t *m, value_t *key, unsigned hash);
-value_t map_remove(su_state *s, map_t *m, value_t *key, unsigned hash);
-value_t map_insert(su_state *s, map_t *m, value_t *key, unsigned hash, value_t *val);
+value_t map_get(su_state *s, map_t *m, value_t *key);
+value_t map_remove(su_state *s, map_t *m, value_t *key);
+value_t map_insert(su_state *s, map_t *m, value_t *key, value_t *val);
 int map_length(map_t *m);
 
+value_t map_transient(su_state *s, map_t *m);
+void map_insert_transient(su_state *s, map_t *m, gc_t *edit, value_t *key, value_t *val);
+void map_remove_transient(su_state *s, map_t *m, gc_t *edit, value_t *key);
+
+#define MAP_ITER_DEPTH 8
+
+typedef struct {
+	int top;
+	node_t *nodes[MAP_ITER_DEPTH];
+	int idx[MAP_ITER_DEPTH];
+} map_iter_t;
+
+void map_iter_init(map_iter_t *it, map_t *m);
+value_t *map_iter_next(map_iter_t *it);
+
+/***********************************************************************************/
+
+typedef struct {
+	gc_t gc;
+	gc_t *edit;
+	value_t coll;
+} transient_t;
+
+/* The owner token of a transient, the pad leaves room for a forwarding pointer when it is moved. */
+typedef struct {
+	gc_t gc;
+	void *pad;
+} edit_t;
+
+gc_t *transient_edit(su_state *s);
+value_t transient_create(su_state *s, value_t *coll);
+value_t transient_persistent(su_state *s, transient_t *t);
+
+/***********************************************************************************/
+
+typedef struct {
+	gc_t gc;
+	value_t val;
+} reduced_t;
+
+value_t reduced_create(su_state *s, value_t *val);
+
+typedef struct {
+	gc_t gc;
+	int kind;
+	value_t arg;
+} xform_t;
+
+value_t xform_create(su_state *s, int kind, value_t *arg);
+
+/***********************************************************************************/
+
+typedef struct {
+	gc_t gc;
+	unsigned len;
+	unsigned cap;
+	char *buf;
+} builder_t;
+
+value_t builder_create(su_state *s);
+void builder_append(su_state *s, builder_t *b, const char *str, unsigned len);
+void builder_append_text(su_state *s, builder_t *b, gc_t *text);
+
+/* The pieces of a rope are strings or other ropes. */
+typedef struct {
+	gc_t gc;
+	unsigned len;
+	unsigned depth;
+	gc_t *left, *right;
+} rope_t;
+
+unsigned text_length(gc_t *text);
+gc_t *rope_concat(su_state *s, gc_t *a, gc_t *b);
+gc_t *rope_slice(su_state *s, gc_t *text, unsigned start, unsigned end);
+gc_t *rope_flatten(su_state *s, gc_t *text);
+
 /***********************************************************************************/
 
 typedef value_t (*seq_fr_func_t)(su_state *s, seq_t *q);
@@ -123,10 +172,13 @@ struct seq {
 };
 
 typedef struct {
-	seq_t q;
-	int idx;
-	gc_t *obj;
-} it_seq_t;
+	gc_t gc;
+	vector_t *vec;
+	vector_node_t *node;
+	int base;
+} chunk_seq_t;
+
+#define chunk_len(c) ((c)->vec->cnt - (c)->base < 32 ? (c)->vec->cnt - (c)->base : 32)
 
 typedef struct {
 	seq_t q;
@@ -136,10 +188,20 @@ typedef struct {
 value_t cell_create_array(su_state *s, value_t *array, int num);
 value_t cell_create(su_state *s, value_t *first, value_t *rest);
 
+typedef struct {
+	seq_t q;
+	value_t thunk, seq;
+} lazy_seq_t;
+
+value_t lazy_create(su_state *s, value_t *thunk);
+value_t lazy_force(su_state *s, lazy_seq_t *lz);
+
 value_t it_create_vector(su_state *s, vector_t *vec);
 value_t it_create_string(su_state *s, string_t *str);
 
-value_t seq_first(su_state *s, seq_t *q);
-value_t seq_rest(su_state *s, seq_t *q);
+value_t seq_first(su_state *s, value_t *q);
+value_t seq_rest(su_state *s, value_t *q);
+int seq_chunk(su_state *s, value_t *q, value_t *buffer);
+value_t seq_chunk_rest(su_state *s, value_t *q);
 
 #endif
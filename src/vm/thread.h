@@ -0,0 +1,124 @@
+/******************************************************************************/
+/* S A U R U S                                                                */
+/* Copyright (c) 2009-2014 Andreas T Jonsson <andreas@saurus.org>             */
+/*                                                                            */
+/* This software is provided 'as-is', without any express or implied          */
+/* warranty. In no event will the authors be held liable for any damages      */
+/* arising from the use of this software.                                     */
+/*                                                                            */
+/* Permission is granted to anyone to use this software for any purpose,      */
+/* including commercial applications, and to alter it and redistribute it     */
+/* freely, subject to the following restrictions:                             */
+/*                                                                            */
+/* 1. The origin of this software must not be misrepresented; you must not    */
+/*    claim that you wrote the original software. If you use this software    */
+/*    in a product, an acknowledgment in the product documentation would be   */
+/*    appreciated but is not required.                                        */
+/*                                                                            */
+/* 2. Altered source versions must be plainly marked as such, and must not be */
+/*    misrepresented as being the original software.                          */
+/*                                                                            */
+/* 3. This notice may not be removed or altered from any source               */
+/*    distribution.                                                           */
+/******************************************************************************/
+
+#ifndef _THREAD_H_
+#define _THREAD_H_
+
+#include "platform.h"
+
+/* Threads and atomics for the parallel collector, kept out of platform.h as unistd.h clashes with the natives. */
+#if defined(SU_OPT_PARALLEL_GC) && defined(_WIN32)
+	#include <windows.h>
+
+	typedef HANDLE thread_t;
+	typedef CRITICAL_SECTION mutex_t;
+
+	#define THREAD_ENTRY(name, arg) static DWORD WINAPI name(LPVOID arg)
+	#define THREAD_RETURN return 0
+
+	static INLINE int thread_start(thread_t *t, LPTHREAD_START_ROUTINE entry, void *arg) {
+		*t = CreateThread(NULL, 0, entry, arg, 0, NULL);
+		return *t != NULL;
+	}
+
+	static INLINE void thread_join(thread_t t) {
+		WaitForSingleObject(t, INFINITE);
+		CloseHandle(t);
+	}
+
+	static INLINE void thread_yield() {
+		SwitchToThread();
+	}
+
+	static INLINE unsigned cpu_count() {
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		return (unsigned)info.dwNumberOfProcessors;
+	}
+
+	static INLINE void mutex_init(mutex_t *m) { InitializeCriticalSection(m); }
+	static INLINE void mutex_destroy(mutex_t *m) { DeleteCriticalSection(m); }
+	static INLINE void mutex_lock(mutex_t *m) { EnterCriticalSection(m); }
+	static INLINE void mutex_unlock(mutex_t *m) { LeaveCriticalSection(m); }
+
+	/* Returns the word as it was before the bits were set. */
+	static INLINE unsigned atomic_or(volatile unsigned *word, unsigned bits) {
+		return (unsigned)InterlockedOr((volatile LONG*)word, (LONG)bits);
+	}
+
+	static INLINE long atomic_add(volatile long *n, long d) {
+		return InterlockedExchangeAdd(n, d) + d;
+	}
+
+	#define memory_fence() MemoryBarrier()
+#elif defined(SU_OPT_PARALLEL_GC)
+	#include <pthread.h>
+	#include <sched.h>
+	#include <unistd.h>
+
+	typedef pthread_t thread_t;
+	typedef pthread_mutex_t mutex_t;
+
+	#define THREAD_ENTRY(name, arg) static void *name(void *arg)
+	#define THREAD_RETURN return NULL
+
+	static INLINE int thread_start(thread_t *t, void *(*entry)(void*), void *arg) {
+		return pthread_create(t, NULL, entry, arg) == 0;
+	}
+
+	static INLINE void thread_join(thread_t t) {
+		pthread_join(t, NULL);
+	}
+
+	static INLINE void thread_yield() {
+		sched_yield();
+	}
+
+	static INLINE unsigned cpu_count() {
+		#if defined(_SC_NPROCESSORS_ONLN)
+			long n = sysconf(_SC_NPROCESSORS_ONLN);
+			return n > 0 ? (unsigned)n : 1;
+		#else
+			return 1;
+		#endif
+	}
+
+	static INLINE void mutex_init(mutex_t *m) { pthread_mutex_init(m, NULL); }
+	static INLINE void mutex_destroy(mutex_t *m) { pthread_mutex_destroy(m); }
+	static INLINE void mutex_lock(mutex_t *m) { pthread_mutex_lock(m); }
+	static INLINE void mutex_unlock(mutex_t *m) { pthread_mutex_unlock(m); }
+
+	/* Returns the word as it was before the bits were set. */
+	static INLINE unsigned atomic_or(volatile unsigned *word, unsigned bits) {
+		return __sync_fetch_and_or(word, bits);
+	}
+
+	static INLINE long atomic_add(volatile long *n, long d) {
+		return __sync_add_and_fetch(n, d);
+	}
+
+	#define memory_fence() __sync_synchronize()
+#endif
+
+#endif